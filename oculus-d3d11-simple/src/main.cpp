@@ -31,6 +31,7 @@ limitations under the License.
 #include <OVR_CAPI.h>  // Include the OculusVR SDK
 #include <Kernel/OVR_Math.h>
 
+#ifdef _WIN32
 #include <comdef.h>
 #include <comip.h>
 
@@ -39,14 +40,32 @@ limitations under the License.
 
 #define OVR_D3D_VERSION 11
 #include <OVR_CAPI_D3D.h>  // Include SDK-rendered code for the D3D version
+#endif
+
+#include <emmintrin.h>
 
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <cfloat>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <stdexcept>
+#include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
+#ifdef _WIN32
 _COM_SMARTPTR_TYPEDEF(IDXGIFactory, __uuidof(IDXGIFactory));
 _COM_SMARTPTR_TYPEDEF(IDXGIAdapter, __uuidof(IDXGIAdapter));
 _COM_SMARTPTR_TYPEDEF(IDXGISwapChain, __uuidof(IDXGISwapChain));
@@ -59,16 +78,103 @@ _COM_SMARTPTR_TYPEDEF(ID3D11DepthStencilView, __uuidof(ID3D11DepthStencilView));
 _COM_SMARTPTR_TYPEDEF(ID3D11Buffer, __uuidof(ID3D11Buffer));
 _COM_SMARTPTR_TYPEDEF(ID3D11RasterizerState, __uuidof(ID3D11RasterizerState));
 _COM_SMARTPTR_TYPEDEF(ID3D11DepthStencilState, __uuidof(ID3D11DepthStencilState));
+_COM_SMARTPTR_TYPEDEF(ID3D11BlendState, __uuidof(ID3D11BlendState));
+_COM_SMARTPTR_TYPEDEF(ID3D11Query, __uuidof(ID3D11Query));
 _COM_SMARTPTR_TYPEDEF(ID3D11VertexShader, __uuidof(ID3D11VertexShader));
 _COM_SMARTPTR_TYPEDEF(ID3D11PixelShader, __uuidof(ID3D11PixelShader));
 _COM_SMARTPTR_TYPEDEF(ID3D11ShaderReflection, __uuidof(ID3D11ShaderReflection));
 _COM_SMARTPTR_TYPEDEF(ID3D11InputLayout, __uuidof(ID3D11InputLayout));
 _COM_SMARTPTR_TYPEDEF(ID3D11SamplerState, __uuidof(ID3D11SamplerState));
 _COM_SMARTPTR_TYPEDEF(ID3DBlob, __uuidof(ID3DBlob));
+#else
+// Elsewhere only the headless software path is built. The D3D interfaces still appear in the
+// signatures it shares with the D3D path but are always null there.
+struct ID3D11Device;
+struct ID3D11DeviceContext;
+struct ID3D11ShaderResourceView;
+typedef ID3D11ShaderResourceView* ID3D11ShaderResourceViewPtr;
+
+template <size_t size, typename... Args>
+int sprintf_s(char (&buffer)[size], const char* format, Args... args) {
+    return snprintf(buffer, size, format, args...);
+}
+
+void OutputDebugStringA(const char* s) { fputs(s, stderr); }
+#endif
 
 using namespace OVR;
 using namespace std;
 
+// Accounts CPU and GPU memory by category and checks it against configurable budgets. When a
+// budget is exceeded the tracker either warns in the debug output or evicts the least recently
+// used allocations of that category that were registered with an evict callback. Warn budgets are
+// checked as allocations are made, Evict budgets at the end of each frame, once the allocations
+// the frame used have been touched.
+struct MemoryTracker {
+    enum Memory { Cpu, Gpu, MemoryCount };
+    enum Category { VertexBuffers, IndexBuffers, Textures, RenderTargets, Staging, CategoryCount };
+    enum Policy { Warn, Evict };
+
+    struct Budget {
+        size_t bytes = SIZE_MAX;
+        Policy policy = Warn;
+    };
+
+    struct Allocation {
+        Memory memory;
+        Category category;
+        size_t bytes;
+        int lastUsedFrame;
+        function<void()> evict;
+        bool live;
+    };
+
+    vector<Allocation> allocations;  // Indexed by allocation id, ids are never reused
+    size_t current[MemoryCount][CategoryCount];
+    size_t peak[MemoryCount][CategoryCount];
+    Budget budgets[MemoryCount][CategoryCount];
+    int frame = 0;
+
+    MemoryTracker();
+    // Registers an allocation without checking the budget, TrackedMemory checks it once the
+    // handle holds the id.
+    int Track(Memory memory, Category category, size_t bytes, function<void()> evict = nullptr);
+    void Release(int id);
+    void Touch(int id) { allocations[id].lastUsedFrame = frame; }
+    // Ends the current frame, enforcing the Evict budgets against what it touched
+    void NextFrame();
+    void SetBudget(Memory memory, Category category, size_t bytes, Policy policy);
+    void EnforceBudget(Memory memory, Category category);
+    void Report() const;
+};
+
+// Owning handle for a tracked allocation, removes it from the tracker when destroyed.
+struct TrackedMemory {
+    MemoryTracker* tracker = nullptr;
+    int id = -1;
+
+    TrackedMemory() {}
+    TrackedMemory(MemoryTracker& tracker, MemoryTracker::Memory memory,
+                  MemoryTracker::Category category, size_t bytes,
+                  function<void()> evict = nullptr);
+    TrackedMemory(TrackedMemory&& other);
+    TrackedMemory& operator=(TrackedMemory&& other);
+    ~TrackedMemory();
+    void Touch() const {
+        if (tracker) tracker->Touch(id);
+    }
+};
+
+// Blend, depth and vertex input setup of a draw, shared by DirectX11 and SoftwareRasterizer
+enum Pipeline {
+    OpaquePipeline,
+    AlphaBlendPipeline,
+    OpaqueInstancedPipeline,
+    AlphaBlendInstancedPipeline,
+    PipelineCount
+};
+
+#ifdef _WIN32
 struct EyeTarget {
     ID3D11Texture2DPtr tex;
     ID3D11ShaderResourceViewPtr srv;
@@ -76,18 +182,292 @@ struct EyeTarget {
     ID3D11DepthStencilViewPtr dsv;
     ovrRecti viewport;
     Sizei size;
+    TrackedMemory colorMemory, depthMemory;
+
+    EyeTarget(ID3D11Device* device, MemoryTracker& memory, Sizei size);
+};
+#endif
+
+// GPU progress markers for reclaiming per frame memory. Signal marks the end of the commands
+// issued so far and returns its value, values start at 1 and increase by one. Completed returns
+// the newest value the GPU has passed, or 0. Kept abstract so the ring can be checked against a
+// fake GPU without a device.
+struct FenceSource {
+    virtual ~FenceSource() {}
+    virtual uint64_t Signal() = 0;
+    virtual uint64_t Completed() = 0;
+};
+
+// Bookkeeping for a ring of GPU memory shared by the frames in flight. Positions are running byte
+// counts, the buffer offset is the position modulo the size. Memory is reclaimed when the fence
+// recorded at the end of a frame completes. Nothing here touches D3D so the owner can drive it
+// with any fence values it likes.
+struct RingAllocator {
+    struct Allocation {
+        uint32_t offset;
+        bool discard;  // Map with DISCARD, everything allocated before is no longer reachable
+    };
+
+    uint32_t size = 0;
+    uint64_t head = 0;  // End of the newest allocation
+    uint64_t tail = 0;  // Start of the oldest allocation the GPU may still read
+    bool discardNext = true;  // The first map of a new buffer has to discard
+    deque<pair<uint64_t, uint64_t>> frames;  // Fence value and head for each frame in flight
+
+    explicit RingAllocator(uint32_t size_ = 0) : size{size_} {}
+    Allocation Allocate(uint32_t bytes, uint32_t alignment);
+    void EndFrame(uint64_t fence) { frames.emplace_back(fence, head); }
+    void Retire(uint64_t completedFence);
+};
+
+// Drives a RingAllocator through wraps, retires and DISCARDs against a fake GPU with random lag,
+// checking that no allocation overlaps memory a frame in flight may still read. Returns the
+// number of violations and reports the counts in the debug output.
+int CheckRingAllocator(int frameCount);
+
+#ifdef _WIN32
+// FenceSource backed by D3D11 event queries, which are recycled once they have completed.
+struct D3D11Fences : FenceSource {
+    ID3D11DevicePtr device;
+    ID3D11DeviceContextPtr context;
+    deque<pair<uint64_t, ID3D11QueryPtr>> pending;
+    vector<ID3D11QueryPtr> freeQueries;
+    uint64_t signalled = 0, completed = 0;
+
+    D3D11Fences(ID3D11Device* device_, ID3D11DeviceContext* context_)
+        : device{device_}, context{context_} {}
+    uint64_t Signal() override;
+    uint64_t Completed() override;
+};
+
+// Transient vertex memory for geometry written by the CPU every frame (instance data, particles,
+// debug geometry). Allocations are mapped with D3D11_MAP_WRITE_NO_OVERWRITE and reclaimed once the
+// event query issued at the end of their frame has completed. When the ring runs out of retired
+// space the buffer is mapped with DISCARD instead, so draw each allocation before mapping the next.
+struct TransientBuffer {
+    ID3D11BufferPtr buffer;
+    RingAllocator ring;
+    unique_ptr<FenceSource> fences;
+    TrackedMemory memory;
+
+    void AllocateBuffer(ID3D11Device* device, ID3D11DeviceContext* context,
+                        MemoryTracker& tracker, UINT size);
+    // Maps room for count elements of stride bytes. The space is element aligned so it can be
+    // drawn starting at element first. Unmap before drawing.
+    void* Map(ID3D11DeviceContext* context, UINT count, UINT stride, UINT& first);
+    void Unmap(ID3D11DeviceContext* context) { context->Unmap(buffer, 0); }
+    // Map, copy and Unmap in one go, returns the first element written
+    UINT Write(ID3D11DeviceContext* context, const void* data, UINT count, UINT stride);
+    void EndFrame() { ring.EndFrame(fences->Signal()); }
+    void Retire() { ring.Retire(fences->Completed()); }
+};
+
+#endif
+
+// Draws for one view, each packed into a 64 bit sort key so that a single sort groups them by
+// layer, pipeline state and texture. Opaque draws are ordered front to back within a state group
+// to help early Z, transparent draws back to front regardless of state.
+struct RenderQueue {
+    enum Layer { OpaqueLayer, TransparentLayer };
+
+    struct Item {
+        uint64_t key;
+        int model;
+    };
+
+    vector<Item> items;
+    vector<Item> scratch;
+    unordered_map<const void*, uint32_t> textureIds;  // D3D or software texture -> key bits
+
+    // Texture ids are handed out afresh for each queue, so they stay dense and never refer to
+    // textures that have since been released
+    void Clear() {
+        items.clear();
+        textureIds.clear();
+    }
+    void Add(Layer layer, unsigned pipeline, const void* texture, float viewDepth, int model);
+    void Sort();
+};
+
+struct Ray {
+    Vector3f origin, dir, invDir;
+
+    Ray(Vector3f origin_, Vector3f dir_)
+        : origin{origin_}, dir{dir_}, invDir{1.0f / dir_.x, 1.0f / dir_.y, 1.0f / dir_.z} {}
+};
+
+struct Aabb {
+    Vector3f lo, hi;
+
+    Aabb() : lo{FLT_MAX, FLT_MAX, FLT_MAX}, hi{-FLT_MAX, -FLT_MAX, -FLT_MAX} {}
+    Aabb(Vector3f lo_, Vector3f hi_) : lo{lo_}, hi{hi_} {}
+
+    void Add(const Vector3f& p);
+    void Add(const Aabb& b);
+    Aabb Translated(const Vector3f& v) const { return Aabb{lo + v, hi + v}; }
+    Vector3f Center() const { return (lo + hi) * 0.5f; }
+    float SurfaceArea() const;
+    float DistanceSq(const Vector3f& p) const;
+    // Slab test, tEntry is the distance along the ray where it enters the box.
+    bool RayHit(const Ray& ray, float tMax, float& tEntry) const;
+};
+
+// Six clip planes extracted from a (proj * view) matrix, normals point inwards.
+struct Frustum {
+    struct Plane {
+        Vector3f n;
+        float d;
+    };
+    array<Plane, 6> planes;
+
+    explicit Frustum(const Matrix4f& viewProj);
+    bool Intersects(const Aabb& b) const;
+};
+
+// Bounding volume hierarchy with one item per leaf. Built top down with a binned SAH and kept
+// in shape by refit plus tree rotations as items move. The query functions are const and keep
+// their traversal state on the stack so any number of readers can run concurrently, as long as
+// Build/Update are not called at the same time.
+struct Bvh {
+    struct Node {
+        Aabb bounds;
+        int parent = -1;
+        int children[2];
+        int item = -1;
+
+        Node() { children[0] = children[1] = -1; }
+        bool IsLeaf() const { return children[0] < 0; }
+    };
+
+    struct Hit {
+        int item = -1;
+        float t = FLT_MAX;  // Ray distance for ray casts, distance to bounds for nearest queries
+    };
+
+    vector<Node> nodes;
+    vector<int> leafOf;  // Item -> leaf node index
+    int root = -1;
+
+    void Build(const vector<Aabb>& itemBounds);
+    void Update(int item, const Aabb& bounds);
+
+    // Culls against several frustums (e.g. both eyes) in one traversal, visible[i] receives the
+    // items intersecting frustums[i]. The frustums share a bit mask, so count is at most 32.
+    void QueryFrustums(const Frustum* frustums, int count, vector<int>* visible) const;
+    // leafTest(item, ray, tMax) returns the hit distance for an item or a negative value on miss.
+    template <typename LeafTest>
+    Hit RayCast(const Ray& ray, float tMax, LeafTest leafTest) const;
+    Hit RayCast(const Ray& ray, float tMax) const;
+    void RayCastBatch(const Ray* rays, int count, float tMax, Hit* hits) const;
+    Hit Nearest(const Vector3f& p, float maxDist) const;
+    void NearestBatch(const Vector3f* points, int count, float maxDist, Hit* hits) const;
+
+private:
+    int BuildRange(int* items, int count, const vector<Aabb>& itemBounds, int parent);
+    void Rotate(int index);
+    // Traversals with a caller supplied stack, so a batch allocates it once for all its queries
+    template <typename LeafTest>
+    Hit RayCast(const Ray& ray, float tMax, LeafTest leafTest, vector<int>& stack) const;
+    Hit Nearest(const Vector3f& p, float maxDist, vector<pair<float, int>>& stack) const;
+    float LeafBoundsHit(int item, const Ray& ray, float tMax) const;
+};
 
-    EyeTarget(ID3D11Device* device, Sizei size);
+// Builds a Bvh over random boxes, moves them around with Update and checks ray, nearest and
+// two-eye frustum queries, single and batched, against a linear scan over the boxes. Returns the
+// number of mismatches and reports the counts in the debug output.
+int CheckBvh(int roundCount);
+
+// RGBA8 texture with its full mip chain in memory, for the software rasterizer. Sizes are powers
+// of two and sampling wraps like the D3D sampler. Every level but the smallest is tracked as
+// evictable, so an Evict budget on CPU textures drops the finest mips of the least recently used
+// textures and sampling falls back to the next resident level.
+struct SoftwareTexture {
+    struct Level {
+        int size;
+        vector<uint32_t> texels;  // Empty once evicted
+    };
+    vector<Level> levels;
+    vector<TrackedMemory> levelMemory;
+
+    // Levels are added from the largest down, the last one added is never evicted
+    void AddLevel(MemoryTracker& memory, int size, const uint32_t* texels, bool evictable);
+    void Touch() const;
+    // Bilinear sample from the mip level nearest to lod, out receives RGBA in [0, 1]
+    void Sample(float u, float v, float lod, float out[4]) const;
+};
+
+struct Model {
+    struct Color {
+        unsigned char r, g, b, a;
+
+        Color(unsigned char r_ = 0, unsigned char g_ = 0, unsigned char b_ = 0,
+              unsigned char a_ = 0xff)
+            : r{r_}, g{g_}, b{b_}, a{a_} {}
+    };
+
+    struct Vertex {
+        Vector3f pos;
+        Color c;
+        float u, v;
+    };
+
+    // Per instance data for instanced models, the top three rows of the instance's model
+    // matrix and a color that multiplies the vertex color.
+    struct Instance {
+        float world[3][4];
+        Color c;
+    };
+
+    Vector3f pos;
+    bool transparent = false;
+    vector<Vertex> vertices;  // CPU copies, released once uploaded by AllocateBuffers to a device
+    vector<uint16_t> indices;
+    int indexCount = 0;
+    Aabb bounds;         // Local space bounds of the whole model
+    vector<Aabb> parts;  // Local space bounds of each box or instance, used to refine picking
+    vector<Instance> instances;  // Drawn with DrawIndexedInstanced when not empty
+    Aabb meshBounds;             // Bounds of a single instance for instanced models
+#ifdef _WIN32
+    ID3D11BufferPtr vertexBuffer;
+    ID3D11BufferPtr indexBuffer;
+    ID3D11ShaderResourceViewPtr textureSrv;
+#endif
+    TrackedMemory vertexMemory, indexMemory;
+    const SoftwareTexture* softwareTexture;
+
+    Model(Vector3f pos_, ID3D11ShaderResourceView* texSrv,
+          const SoftwareTexture* softwareTex = nullptr)
+        : pos{pos_}, softwareTexture{softwareTex} {
+#ifdef _WIN32
+        textureSrv = texSrv;
+#else
+        (void)texSrv;
+#endif
+    }
+
+    Matrix4f GetMatrix() { return Matrix4f::Translation(pos); }
+    Aabb GetWorldBounds() const { return bounds.Translated(pos); }
+    Pipeline GetPipeline() const;
+    const void* GetTexture() const;  // Whichever of the D3D or software texture is set
+    // Without a device the CPU copies are kept for the software rasterizer
+    void AllocateBuffers(ID3D11Device* device, MemoryTracker& memory);
+    void AddSolidColorBox(float x1, float y1, float z1, float x2, float y2, float z2, Color c);
+    void AddInstance(const Matrix4f& world, Color c);
+    // FNV-1a hash of the vertex and index data, only valid before AllocateBuffers
+    uint64_t ContentHash() const;
 };
 
+#ifdef _WIN32
 struct DirectX11 {
     HINSTANCE hinst = nullptr;
     HWND window = nullptr;
     array<bool, 256> keys;
+    MemoryTracker memory;  // Declared before any tracked resources so it outlives them
     ID3D11DevicePtr device;
     ID3D11DeviceContextPtr context;
     IDXGISwapChainPtr swapChain;
     ID3D11RenderTargetViewPtr backBufferRT;
+    TrackedMemory backBufferMemory;
     ID3D11BufferPtr uniformBufferGen;
     ID3D11SamplerStatePtr samplerState;
     ID3D11VertexShaderPtr vShader;
@@ -95,51 +475,190 @@ struct DirectX11 {
     unordered_map<string, int> uniformOffsets;
     ID3D11PixelShaderPtr pShader;
     ID3D11InputLayoutPtr inputLayout;
+    ID3D11VertexShaderPtr vShaderInstanced;
+    ID3D11InputLayoutPtr inputLayoutInstanced;
+    TransientBuffer transient;  // Instance data and CPU generated geometry
+
+    struct PipelineState {
+        ID3D11BlendStatePtr blendState;
+        ID3D11DepthStencilStatePtr depthStencilState;
+        ID3D11VertexShaderPtr vertexShader;
+        ID3D11InputLayoutPtr inputLayout;
+    };
+    array<PipelineState, PipelineCount> pipelines;
+
+    // Last state bound by Render, reset whenever the eye target is set since the SDK distortion
+    // rendering changes state behind our back.
+    struct BoundState {
+        int pipeline = -1;
+        ID3D11ShaderResourceView* texSrv = nullptr;
+        ID3D11Buffer* vertices = nullptr;
+        ID3D11Buffer* indices = nullptr;
+        UINT stride = 0;
+    } bound;
+
+    struct Stats {
+        int draws = 0;
+        int pipelineChanges = 0;
+        int textureChanges = 0;
+        int bufferChanges = 0;
+        int instances = 0;
+    } stats;
 
     DirectX11(HINSTANCE hinst, const Recti& vp);
     ~DirectX11();
+    void BeginFrame();
+    void EndFrame();
     void ClearAndSetEyeTarget(const EyeTarget& eyeTarget);
-    void Render(ID3D11ShaderResourceView* texSrv, ID3D11Buffer* vertices, ID3D11Buffer* indices,
-                UINT stride, int count);
+    // Draw interface shared with SoftwareRasterizer: a model with the current World uniform, or
+    // some of the instances of an instanced model, which are streamed through transient.
+    void Render(const Model& model);
+    void RenderInstanced(const Model& model, const Model::Instance* instances, int instanceCount);
+    // Draws count vertices starting at first from the transient buffer, see TransientBuffer::Map
+    void RenderTransient(Pipeline pipeline, ID3D11ShaderResourceView* texSrv, UINT stride,
+                         int count, UINT first);
     void SetUniform(const char* name, int n, const float* v);
+
+private:
+    void Bind(Pipeline pipeline, ID3D11ShaderResourceView* texSrv, ID3D11Buffer* vertices,
+              ID3D11Buffer* indices, UINT stride);
 };
+#endif
 
-struct Model {
-    struct Color {
-        unsigned char r, g, b, a;
+// CPU eye buffer with RGBA8 color and float depth. Rows are padded to a multiple of four pixels
+// so the raster loops can always load and store whole SSE vectors.
+struct SoftwareTarget {
+    int width, height, stride;
+    vector<uint32_t> color;
+    vector<float> depth;
 
-        Color(unsigned char r_ = 0, unsigned char g_ = 0, unsigned char b_ = 0,
-              unsigned char a_ = 0xff)
-            : r{r_}, g{g_}, b{b_}, a{a_} {}
+    explicit SoftwareTarget(Sizei size);
+    void WriteTga(const char* filename) const;
+};
+
+// Multithreaded tile based rasterizer behind the same draw interface as DirectX11, running a port
+// of the room shaders for headless rendering. Draws are transformed, clipped and binned into
+// tiles as they are submitted. Finish rasterizes the tiles on all cores, each tile drawing its
+// triangles in submission order, so the result doesn't depend on the thread count.
+struct SoftwareRasterizer {
+    static const int TileSize = 64;
+
+    enum Attribute { U, V, R, G, B, A, WorldX, WorldY, WorldZ, AttributeCount };
+
+    // Value that varies linearly in screen space, evaluated at pixel centres
+    struct Interpolant {
+        float dx, dy, c;
+        float At(float x, float y) const { return dx * x + dy * y + c; }
     };
 
-    struct Vertex {
-        Vector3f pos;
-        Color c;
-        float u, v;
+    struct Triangle {
+        Interpolant edges[3];  // Positive inside
+        bool topLeft[3];       // Fill rule, pixels exactly on an edge belong to top and left edges
+        Interpolant z, invW;
+        Interpolant attributes[AttributeCount];  // Attribute / w, for perspective correction
+        Vector3f normal;
+        const SoftwareTexture* texture;
+        bool blend;
+        int minX, minY, maxX, maxY;  // Pixel bounds clamped to the target
     };
 
-    Vector3f pos;
-    vector<Vertex> vertices;
-    vector<uint16_t> indices;
-    ID3D11BufferPtr vertexBuffer;
-    ID3D11BufferPtr indexBuffer;
-    ID3D11ShaderResourceViewPtr textureSrv;
+    struct Stats {
+        int draws = 0;
+        int triangles = 0;  // After culling and clipping
+        long long pixelsShaded = 0;
+    };
 
-    Model(Vector3f pos_, ID3D11ShaderResourceView* texSrv) : pos{pos_}, textureSrv{texSrv} {}
+    SoftwareTarget* target = nullptr;
+    unordered_map<string, Matrix4f> uniforms;
+    Stats stats;
 
-    Matrix4f GetMatrix() { return Matrix4f::Translation(pos); }
-    void AllocateBuffers(ID3D11Device* device);
-    void Model::AddSolidColorBox(float x1, float y1, float z1, float x2, float y2, float z2,
-                                 Color c);
+    explicit SoftwareRasterizer(unsigned threadCount = thread::hardware_concurrency());
+    ~SoftwareRasterizer();
+
+    void ClearAndSetEyeTarget(SoftwareTarget& eyeTarget);
+    void SetUniform(const char* name, int n, const float* v);
+    // Same draw interface as DirectX11, drawing from the model's CPU copies
+    void Render(const Model& model);
+    void RenderInstanced(const Model& model, const Model::Instance* instances, int instanceCount);
+    // Rasterizes everything drawn since the target was set, blocking until done
+    void Finish();
+
+private:
+    struct ClipVertex {
+        float pos[4];
+        float attributes[AttributeCount];
+    };
+
+    void Draw(Pipeline pipeline, const SoftwareTexture* texture, const Matrix4f& world,
+              Model::Color instanceColor, const Model::Vertex* vertices, const uint16_t* indices,
+              int count);
+    void Setup(const ClipVertex& v0, const ClipVertex& v1, const ClipVertex& v2,
+               const SoftwareTexture* texture, bool blend);
+    void RasterTiles();
+    void RasterTile(int tile);
+    uint32_t Shade(const Triangle& tri, int x, int y, uint32_t dest) const;
+    void WorkerLoop();
+
+    vector<ClipVertex> transformed;
+    vector<Triangle> triangles;
+    vector<vector<int>> bins;  // Triangle indices per tile
+    int tilesX = 0, tilesY = 0;
+
+    vector<thread> workers;
+    mutex workMutex;
+    condition_variable workReady, workDone;
+    int generation = 0;  // Bumped for each Finish, wakes the workers
+    int busyWorkers = 0;
+    bool quit = false;
+    atomic<int> nextTile;
+    atomic<long long> pixelsShaded;
 };
 
 struct Scene {
-    vector<unique_ptr<Model>> models;
+    // A shared mesh of instanced boxes, with its own copy of the geometry to rule out hash
+    // collisions since the D3D path drops the model's copy once it is on the GPU
+    struct InstancedMesh {
+        Model* model;
+        vector<Model::Vertex> vertices;
+        vector<uint16_t> indices;
+    };
 
-    Scene(ID3D11Device* device, ID3D11DeviceContext* deviceContext);
+    vector<unique_ptr<Model>> models;
+    Bvh bvh;
+    Matrix4f eyeView[2], eyeProj[2];
+    vector<Frustum> eyeFrustums;
+    vector<int> visible[2];  // Models inside each eye frustum
+    RenderQueue queue;
+    vector<TrackedMemory> textureMemory;
+    unordered_multimap<uint64_t, InstancedMesh> instancedMeshes;  // By content and texture hash
+    vector<Model::Instance> visibleInstances;
+
+    vector<unique_ptr<SoftwareTexture>> softwareTextures;
+
+    // Without a device the textures and geometry stay on the CPU for the software rasterizer
+    Scene(ID3D11Device* device, ID3D11DeviceContext* deviceContext, MemoryTracker& memory);
+
+    // Adds a box as an instance of a shared unit box mesh of the same size and texture, creating
+    // the instanced model the first time a size is seen.
+    void AddInstancedBox(ID3D11Device* device, MemoryTracker& memory,
+                         ID3D11ShaderResourceView* texSrv, const SoftwareTexture* softwareTex,
+                         float x1, float y1, float z1, float x2, float y2, float z2,
+                         Model::Color c);
+
+    void MoveModel(int index, Vector3f pos);
+    // Returns the closest model hit by the ray, tested against the individual boxes of a model.
+    Bvh::Hit Pick(const Ray& ray, float maxDist) const;
+    // Culls the models against both eye frustums in one traversal, before rendering either eye
+    void Cull(const Matrix4f (&view)[2], const Matrix4f (&proj)[2]);
+    // Renders one eye as culled by Cull, with DirectX11 or SoftwareRasterizer
+    template <typename Renderer>
+    void Render(Renderer& renderer, int eye);
 
-    void Render(DirectX11& dx11, const Matrix4f& view, const Matrix4f& proj);
+private:
+    // Fills the sorted render queue with the models visible to an eye
+    void BuildQueue(int eye);
+    // Gathers the instances of an instanced model that are inside the frustum
+    void CullInstances(const Model& model, const Frustum& frustum);
 };
 
 void throwOnError(ovrBool res, ovrHmd hmd = nullptr) {
@@ -166,12 +685,39 @@ scope_exit<Func> on_scope_exit(Func f) {
     return scope_exit<Func>{f};
 };
 
+// Position of the animated cube at a given frame
+Vector3f MovingBoxPos(int appClock) {
+    return Vector3f{9 * sin(0.01f * appClock), 3, 9 * cos(0.01f * appClock)};
+}
+
+// View matrix for an eye of the player at pos, turned by yaw
+Matrix4f EyeView(const Vector3f& pos, float yaw, const ovrPosef& eyePose) {
+    const Matrix4f rollPitchYaw = Matrix4f::RotationY(yaw);
+    const Matrix4f finalRollPitchYaw = rollPitchYaw * Matrix4f(eyePose.Orientation);
+    const Vector3f finalUp = finalRollPitchYaw.Transform(Vector3f{0, 1, 0});
+    const Vector3f finalForward = finalRollPitchYaw.Transform(Vector3f{0, 0, -1});
+    const Vector3f shiftedEyePos = pos + rollPitchYaw.Transform(eyePose.Position);
+    return Matrix4f::LookAtRH(shiftedEyePos, shiftedEyePos + finalForward, finalUp);
+}
+
+int RenderHeadless(int frameCount, size_t textureBudget);
+
+#ifdef _WIN32
 //-------------------------------------------------------------------------------------
-int WINAPI WinMain(HINSTANCE hinst, HINSTANCE, LPSTR /*args*/, int) {
+int WINAPI WinMain(HINSTANCE hinst, HINSTANCE, LPSTR args, int) {
     // Initialize the OVR SDK
     throwOnError(ovr_Initialize());
     auto ovr = on_scope_exit([] { ovr_Shutdown(); });
 
+    // Render with the software rasterizer instead, without a window, Rift or GPU
+    if (strstr(args, "-headless")) {
+        const char* budget = strstr(args, "-texturebudget ");
+        return RenderHeadless(100,
+                              budget ? static_cast<size_t>(atoi(budget + 15)) << 10 : SIZE_MAX);
+    }
+    if (strstr(args, "-checkring")) return CheckRingAllocator(10000) ? 1 : 0;
+    if (strstr(args, "-checkbvh")) return CheckBvh(100) ? 1 : 0;
+
     // Create the HMD
     auto hmdCreate = [] {
         auto hmd = ovrHmd_Create(0);
@@ -203,12 +749,23 @@ int WINAPI WinMain(HINSTANCE hinst, HINSTANCE, LPSTR /*args*/, int) {
                                           0),
                  hmd.get());
 
+    // Memory budgets for shared kiosk machines, anything over budget is reported in the debug
+    // output. None of these allocations can be recreated on demand, so they only warn; only the
+    // headless renderer's CPU texture mips are evictable, see -texturebudget.
+    dx11.memory.SetBudget(MemoryTracker::Gpu, MemoryTracker::Textures, 16 << 20,
+                          MemoryTracker::Warn);
+    dx11.memory.SetBudget(MemoryTracker::Gpu, MemoryTracker::RenderTargets, 96 << 20,
+                          MemoryTracker::Warn);
+    dx11.memory.SetBudget(MemoryTracker::Cpu, MemoryTracker::Staging, 4 << 20,
+                          MemoryTracker::Warn);
+
     // Create the eye render targets.
     const EyeTarget eyeTargets[] = {
-        {dx11.device,
+        {dx11.device, dx11.memory,
          ovrHmd_GetFovTextureSize(hmd.get(), ovrEye_Left, hmd->DefaultEyeFov[ovrEye_Left], 1.0f)},
-        {dx11.device, ovrHmd_GetFovTextureSize(hmd.get(), ovrEye_Right,
-                                               hmd->DefaultEyeFov[ovrEye_Right], 1.0f)}};
+        {dx11.device, dx11.memory, ovrHmd_GetFovTextureSize(hmd.get(), ovrEye_Right,
+                                                            hmd->DefaultEyeFov[ovrEye_Right],
+                                                            1.0f)}};
 
     // Configure SDK rendering
     auto eyeRenderDesc = [&dx11, &hmd] {
@@ -232,7 +789,8 @@ int WINAPI WinMain(HINSTANCE hinst, HINSTANCE, LPSTR /*args*/, int) {
     }();
 
     // Create the room models
-    Scene roomScene{dx11.device, dx11.context};
+    Scene roomScene{dx11.device, dx11.context, dx11.memory};
+    dx11.memory.Report();
 
     float yaw = 3.141592f;            // Horizontal rotation of the player
     Vector3f pos{0.0f, 1.6f, -5.0f};  // Position of player
@@ -255,6 +813,7 @@ int WINAPI WinMain(HINSTANCE hinst, HINSTANCE, LPSTR /*args*/, int) {
                                                 eyeRenderDesc[1].HmdToEyeViewOffset};
 
         ovrHmd_BeginFrame(hmd.get(), 0);
+        dx11.BeginFrame();
 
         // Recenter the Rift by pressing 'R'
         if (dx11.keys['R']) ovrHmd_RecenterPose(hmd.get());
@@ -279,35 +838,60 @@ int WINAPI WinMain(HINSTANCE hinst, HINSTANCE, LPSTR /*args*/, int) {
         pos.y = ovrHmd_GetFloat(hmd.get(), OVR_KEY_EYE_HEIGHT, pos.y);
 
         // Animate the cube
-        roomScene.models[0]->pos =
-            Vector3f{9 * sin(0.01f * appClock), 3, 9 * cos(0.01f * appClock)};
+        roomScene.MoveModel(0, MovingBoxPos(appClock));
 
         // Get both eye poses simultaneously, with IPD offset already included.
         ovrPosef eyePoses[2] = {};
         ovrHmd_GetEyePoses(hmd.get(), 0, useHmdToEyeViewOffset, eyePoses, nullptr);
 
-        // Render the two undistorted eye views into their render buffers.
+        // Find what the player looks at, along the line of sight from between the eyes
+        const Matrix4f gazeRotation =
+            Matrix4f::RotationY(yaw) * Matrix4f(eyePoses[0].Orientation);
+        const Vector3f gazeOrigin =
+            pos + Matrix4f::RotationY(yaw).Transform(
+                      (Vector3f(eyePoses[0].Position) + Vector3f(eyePoses[1].Position)) * 0.5f);
+        const Ray gaze{gazeOrigin, gazeRotation.Transform(Vector3f{0, 0, -1})};
+        const Bvh::Hit gazeHit = roomScene.Pick(gaze, 100.0f);
+
+        // Get view and projection matrices (note near Z to reduce eye strain) and cull the scene
+        // for both eyes at once
+        Matrix4f views[2], projs[2];
         for (int eye = 0; eye < 2; ++eye) {
-            const auto& useTarget = eyeTargets[eye];
-            const auto& useEyePose = eyePoses[eye];
-
-            dx11.ClearAndSetEyeTarget(useTarget);
-
-            // Get view and projection matrices (note near Z to reduce eye strain)
-            const Matrix4f rollPitchYaw = Matrix4f::RotationY(yaw);
-            const Matrix4f finalRollPitchYaw = rollPitchYaw * Matrix4f(useEyePose.Orientation);
-            const Vector3f finalUp = finalRollPitchYaw.Transform(Vector3f{0, 1, 0});
-            const Vector3f finalForward = finalRollPitchYaw.Transform(Vector3f{0, 0, -1});
-            const Vector3f shiftedEyePos = pos + rollPitchYaw.Transform(useEyePose.Position);
+            views[eye] = EyeView(pos, yaw, eyePoses[eye]);
+            projs[eye] = ovrMatrix4f_Projection(eyeRenderDesc[eye].Fov, 0.2f, 1000.0f, true);
+        }
+        roomScene.Cull(views, projs);
 
-            const Matrix4f view =
-                Matrix4f::LookAtRH(shiftedEyePos, shiftedEyePos + finalForward, finalUp);
-            const Matrix4f proj =
-                ovrMatrix4f_Projection(eyeRenderDesc[eye].Fov, 0.2f, 1000.0f, true);
+        // Render the two undistorted eye views into their render buffers.
+        for (int eye = 0; eye < 2; ++eye) {
+            dx11.ClearAndSetEyeTarget(eyeTargets[eye]);
 
             // Render the scene
-            roomScene.Render(dx11, view, proj);
+            roomScene.Render(dx11, eye);
+
+            // Gaze cursor, a small quad facing the player just in front of the hit point. It is
+            // generated every frame so it goes through the transient buffer. It is drawn with a
+            // null texture, which samples as zero, so the cursor is black.
+            if (gazeHit.item >= 0) {
+                const Vector3f centre = gaze.origin + gaze.dir * (gazeHit.t - 0.02f);
+                const Vector3f right = gazeRotation.Transform(Vector3f{0.02f, 0, 0});
+                const Vector3f up = gazeRotation.Transform(Vector3f{0, 0.02f, 0});
+                const Vector3f corners[6] = {centre - right + up, centre + right + up,
+                                             centre + right - up, centre - right + up,
+                                             centre + right - up, centre - right - up};
+                UINT first;
+                auto vertices = static_cast<Model::Vertex*>(
+                    dx11.transient.Map(dx11.context, 6, sizeof(Model::Vertex), first));
+                for (int i = 0; i < 6; ++i)
+                    vertices[i] = Model::Vertex{corners[i], Model::Color{255, 255, 255}, 0, 0};
+                dx11.transient.Unmap(dx11.context);
+
+                const Matrix4f world;
+                dx11.SetUniform("World", 16, &world.M[0][0]);
+                dx11.RenderTransient(OpaquePipeline, nullptr, sizeof(Model::Vertex), 6, first);
+            }
         }
+        dx11.EndFrame();
 
         // Do distortion rendering, Present and flush/sync
         [&eyeTargets, &eyePoses, &hmd] {
@@ -321,11 +905,114 @@ int WINAPI WinMain(HINSTANCE hinst, HINSTANCE, LPSTR /*args*/, int) {
             }
             ovrHmd_EndFrame(hmd.get(), eyePoses, &eyeTexture[0].Texture);
         }();
+
+        // Report the state changes left after sorting the render queue
+        if (appClock % 100 == 0) {
+            char buf[256];
+            sprintf_s(buf,
+                      "Frame %d: %d draws, %d instances, %d pipeline, %d texture, %d buffer "
+                      "changes\n",
+                      appClock, dx11.stats.draws, dx11.stats.instances, dx11.stats.pipelineChanges,
+                      dx11.stats.textureChanges, dx11.stats.bufferChanges);
+            OutputDebugStringA(buf);
+        }
+    }
+
+    return 0;
+}
+#else
+// Without D3D only the headless renderer and the ring check are built
+int main(int argc, char** argv) {
+    throwOnError(ovr_Initialize());
+    auto ovr = on_scope_exit([] { ovr_Shutdown(); });
+
+    size_t textureBudget = SIZE_MAX;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-checkring")) return CheckRingAllocator(10000) ? 1 : 0;
+        if (!strcmp(argv[i], "-checkbvh")) return CheckBvh(100) ? 1 : 0;
+        if (!strcmp(argv[i], "-texturebudget") && i + 1 < argc)
+            textureBudget = static_cast<size_t>(atoi(argv[++i])) << 10;
+    }
+    return RenderHeadless(100, textureBudget);
+}
+#endif
+
+// Renders frameCount frames of both eye views with the software rasterizer, using a debug DK2 for
+// the eye fields of view and offsets. Throughput goes to stdout, and on Windows also to the
+// debug output, followed by the memory report. The last frame is written to eye0.tga and
+// eye1.tga. With a texture budget in bytes, the finest mips of the least recently drawn textures
+// are dropped at the end of a frame while over budget.
+int RenderHeadless(int frameCount, size_t textureBudget) {
+    auto hmdDestroy = [](ovrHmd hmd) { ovrHmd_Destroy(hmd); };
+    unique_ptr<const ovrHmdDesc, decltype(hmdDestroy)> hmd{ovrHmd_CreateDebug(ovrHmd_DK2),
+                                                           hmdDestroy};
+    throwOnError(hmd != nullptr);
+
+    MemoryTracker memory;
+    if (textureBudget != SIZE_MAX)
+        memory.SetBudget(MemoryTracker::Cpu, MemoryTracker::Textures, textureBudget,
+                         MemoryTracker::Evict);
+    Scene roomScene{nullptr, nullptr, memory};
+    SoftwareRasterizer rasterizer;
+
+    vector<SoftwareTarget> eyeTargets;
+    ovrEyeRenderDesc eyeRenderDesc[2];
+    for (int eye = 0; eye < 2; ++eye) {
+        const auto eyeType = static_cast<ovrEyeType>(eye);
+        eyeTargets.emplace_back(
+            ovrHmd_GetFovTextureSize(hmd.get(), eyeType, hmd->DefaultEyeFov[eye], 1.0f));
+        eyeRenderDesc[eye] = ovrHmd_GetRenderDesc(hmd.get(), eyeType, hmd->DefaultEyeFov[eye]);
+    }
+
+    // The player stands still at the start position looking ahead with the head centred
+    const float yaw = 3.141592f;
+    const Vector3f pos{0.0f, 1.6f, -5.0f};
+
+    const auto start = chrono::high_resolution_clock::now();
+    for (int appClock = 1; appClock <= frameCount; ++appClock) {
+        roomScene.MoveModel(0, MovingBoxPos(appClock));
+        Matrix4f views[2], projs[2];
+        for (int eye = 0; eye < 2; ++eye) {
+            ovrPosef eyePose{};
+            eyePose.Orientation.w = 1.0f;
+            eyePose.Position = eyeRenderDesc[eye].HmdToEyeViewOffset;
+            views[eye] = EyeView(pos, yaw, eyePose);
+            projs[eye] = ovrMatrix4f_Projection(eyeRenderDesc[eye].Fov, 0.2f, 1000.0f, true);
+        }
+        roomScene.Cull(views, projs);
+        for (int eye = 0; eye < 2; ++eye) {
+            rasterizer.ClearAndSetEyeTarget(eyeTargets[eye]);
+            roomScene.Render(rasterizer, eye);
+            rasterizer.Finish();
+        }
+        memory.NextFrame();
     }
+    const double seconds =
+        chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+
+    long long pixels = 0;
+    for (const auto& target : eyeTargets) pixels += target.width * target.height;
+    pixels *= frameCount;
+
+    char buf[256];
+    sprintf_s(buf,
+              "Headless: %d frames in %.2f s, %.1f Mpixels/s output, %.1f Mpixels/s shaded, "
+              "%d triangles per frame\n",
+              frameCount, seconds, pixels / seconds * 1e-6,
+              rasterizer.stats.pixelsShaded / seconds * 1e-6,
+              rasterizer.stats.triangles / max(frameCount, 1));
+    fputs(buf, stdout);
+#ifdef _WIN32
+    OutputDebugStringA(buf);  // Elsewhere the debug output is stderr, which would repeat it
+#endif
+    memory.Report();
 
+    eyeTargets[0].WriteTga("eye0.tga");
+    eyeTargets[1].WriteTga("eye1.tga");
     return 0;
 }
 
+#ifdef _WIN32
 void ThrowOnFailure(HRESULT hr) {
     if (FAILED(hr)) {
         _com_error err{hr};
@@ -334,7 +1021,118 @@ void ThrowOnFailure(HRESULT hr) {
     }
 }
 
-EyeTarget::EyeTarget(ID3D11Device* device, Sizei requestedSize) {
+size_t TextureBytes(const D3D11_TEXTURE2D_DESC& desc, size_t bytesPerTexel) {
+    size_t bytes = 0;
+    for (UINT level = 0; level < max(desc.MipLevels, 1u); ++level)
+        bytes += max(desc.Width >> level, 1u) * max(desc.Height >> level, 1u) * bytesPerTexel;
+    return bytes * desc.ArraySize;
+}
+#endif
+
+MemoryTracker::MemoryTracker() {
+    for (auto& c : current) fill(begin(c), end(c), 0);
+    for (auto& p : peak) fill(begin(p), end(p), 0);
+}
+
+int MemoryTracker::Track(Memory memory, Category category, size_t bytes,
+                         function<void()> evict) {
+    allocations.push_back(Allocation{memory, category, bytes, frame, move(evict), true});
+    current[memory][category] += bytes;
+    peak[memory][category] = max(peak[memory][category], current[memory][category]);
+    return static_cast<int>(allocations.size()) - 1;
+}
+
+void MemoryTracker::Release(int id) {
+    auto& allocation = allocations[id];
+    if (!allocation.live) return;  // Already evicted
+    allocation.live = false;
+    allocation.evict = nullptr;
+    current[allocation.memory][allocation.category] -= allocation.bytes;
+}
+
+void MemoryTracker::NextFrame() {
+    for (int memory = 0; memory < MemoryCount; ++memory)
+        for (int category = 0; category < CategoryCount; ++category)
+            if (budgets[memory][category].policy == Evict)
+                EnforceBudget(static_cast<Memory>(memory), static_cast<Category>(category));
+    ++frame;
+}
+
+void MemoryTracker::SetBudget(Memory memory, Category category, size_t bytes, Policy policy) {
+    budgets[memory][category].bytes = bytes;
+    budgets[memory][category].policy = policy;
+    if (policy == Warn) EnforceBudget(memory, category);
+}
+
+void MemoryTracker::EnforceBudget(Memory memory, Category category) {
+    const auto& budget = budgets[memory][category];
+    if (budget.policy == Evict) {
+        while (current[memory][category] > budget.bytes) {
+            auto lru = end(allocations);
+            for (auto it = begin(allocations); it != end(allocations); ++it)
+                if (it->live && it->evict && it->memory == memory && it->category == category &&
+                    (lru == end(allocations) || it->lastUsedFrame < lru->lastUsedFrame))
+                    lru = it;
+            if (lru == end(allocations)) break;  // Ties go to the oldest allocation
+
+            // Release before evicting, the callback may destroy the owning handle
+            auto evict = move(lru->evict);
+            Release(static_cast<int>(lru - begin(allocations)));
+            evict();
+        }
+    }
+
+    if (current[memory][category] > budget.bytes) {
+        char buf[256];
+        sprintf_s(buf, "Memory budget exceeded: %s category %d uses %u KB of %u KB\n",
+                  memory == Gpu ? "GPU" : "CPU", category,
+                  static_cast<unsigned>(current[memory][category] >> 10),
+                  static_cast<unsigned>(budget.bytes >> 10));
+        OutputDebugStringA(buf);
+    }
+}
+
+void MemoryTracker::Report() const {
+    const char* names[CategoryCount] = {"Vertex buffers", "Index buffers", "Textures",
+                                        "Render targets", "Staging"};
+    for (int memory = 0; memory < MemoryCount; ++memory)
+        for (int category = 0; category < CategoryCount; ++category) {
+            char buf[256];
+            sprintf_s(buf, "%s %s: %u KB (peak %u KB)\n", memory == Gpu ? "GPU" : "CPU",
+                      names[category], static_cast<unsigned>(current[memory][category] >> 10),
+                      static_cast<unsigned>(peak[memory][category] >> 10));
+            OutputDebugStringA(buf);
+        }
+}
+
+TrackedMemory::TrackedMemory(MemoryTracker& tracker_, MemoryTracker::Memory memory,
+                             MemoryTracker::Category category, size_t bytes,
+                             function<void()> evict)
+    : tracker{&tracker_}, id{tracker_.Track(memory, category, bytes, move(evict))} {
+    if (tracker->budgets[memory][category].policy == MemoryTracker::Warn)
+        tracker->EnforceBudget(memory, category);
+}
+
+TrackedMemory::TrackedMemory(TrackedMemory&& other) : tracker{other.tracker}, id{other.id} {
+    other.tracker = nullptr;
+}
+
+TrackedMemory& TrackedMemory::operator=(TrackedMemory&& other) {
+    if (this != &other) {
+        if (tracker) tracker->Release(id);
+        tracker = other.tracker;
+        id = other.id;
+        other.tracker = nullptr;
+    }
+    return *this;
+}
+
+TrackedMemory::~TrackedMemory() {
+    if (tracker) tracker->Release(id);
+}
+
+#ifdef _WIN32
+EyeTarget::EyeTarget(ID3D11Device* device, MemoryTracker& memory, Sizei requestedSize) {
     CD3D11_TEXTURE2D_DESC texDesc(DXGI_FORMAT_R8G8B8A8_UNORM, requestedSize.w, requestedSize.h);
     texDesc.MipLevels = 1;
     texDesc.BindFlags |= D3D11_BIND_RENDER_TARGET;
@@ -343,6 +1141,8 @@ EyeTarget::EyeTarget(ID3D11Device* device, Sizei requestedSize) {
     device->CreateRenderTargetView(tex, nullptr, &rtv);
     tex->GetDesc(&texDesc);  // Get the actual size in case it was adjusted on create
     size = Sizei(texDesc.Width, texDesc.Height);
+    colorMemory = TrackedMemory{memory, MemoryTracker::Gpu, MemoryTracker::RenderTargets,
+                                TextureBytes(texDesc, 4)};
 
     CD3D11_TEXTURE2D_DESC dsDesc{DXGI_FORMAT_D32_FLOAT, texDesc.Width, texDesc.Height};
     dsDesc.MipLevels = 1;
@@ -350,6 +1150,8 @@ EyeTarget::EyeTarget(ID3D11Device* device, Sizei requestedSize) {
     ID3D11Texture2DPtr dsTex;
     device->CreateTexture2D(&dsDesc, nullptr, &dsTex);
     device->CreateDepthStencilView(dsTex, nullptr, &dsv);
+    depthMemory = TrackedMemory{memory, MemoryTracker::Gpu, MemoryTracker::RenderTargets,
+                                TextureBytes(dsDesc, 4)};
 
     viewport.Pos = Vector2i{0, 0};
     viewport.Size = Sizei(texDesc.Width, texDesc.Height);
@@ -443,6 +1245,14 @@ DirectX11::DirectX11(HINSTANCE hinst_, const Recti& vp) : hinst{hinst_} {
         ThrowOnFailure(dev->CreateRenderTargetView(backBuffer, nullptr, backBufferRtv));
     }(swapChain, device, &backBufferRT);
 
+    [this](IDXGISwapChain* sc) {
+        DXGI_SWAP_CHAIN_DESC scDesc{};
+        ThrowOnFailure(sc->GetDesc(&scDesc));
+        const auto& mode = scDesc.BufferDesc;
+        backBufferMemory = TrackedMemory{memory, MemoryTracker::Gpu, MemoryTracker::RenderTargets,
+                                         scDesc.BufferCount * mode.Width * mode.Height * 4};
+    }(swapChain);
+
     [](ID3D11Device* dev, ID3D11Buffer** uniformBuffer) {
         CD3D11_BUFFER_DESC desc{2000u, D3D11_BIND_CONSTANT_BUFFER, D3D11_USAGE_DYNAMIC,
                                 D3D11_CPU_ACCESS_WRITE};
@@ -456,12 +1266,30 @@ DirectX11::DirectX11(HINSTANCE hinst_, const Recti& vp) : hinst{hinst_} {
         ctx->RSSetState(rasterizerState);
     }(device, context);
 
-    [](ID3D11Device* dev, ID3D11DeviceContext* ctx) {
-        CD3D11_DEPTH_STENCIL_DESC desc{D3D11_DEFAULT};
-        ID3D11DepthStencilStatePtr depthStencilState;
-        ThrowOnFailure(dev->CreateDepthStencilState(&desc, &depthStencilState));
-        ctx->OMSetDepthStencilState(depthStencilState, 0);
-    }(device, context);
+    [](ID3D11Device* dev, array<PipelineState, PipelineCount>& states) {
+        CD3D11_DEPTH_STENCIL_DESC depthDesc{D3D11_DEFAULT};
+        ThrowOnFailure(
+            dev->CreateDepthStencilState(&depthDesc, &states[OpaquePipeline].depthStencilState));
+
+        // Transparent geometry is depth tested but doesn't write depth
+        depthDesc.DepthWriteMask = D3D11_DEPTH_WRITE_MASK_ZERO;
+        ThrowOnFailure(dev->CreateDepthStencilState(
+            &depthDesc, &states[AlphaBlendPipeline].depthStencilState));
+
+        CD3D11_BLEND_DESC blendDesc{D3D11_DEFAULT};
+        ThrowOnFailure(dev->CreateBlendState(&blendDesc, &states[OpaquePipeline].blendState));
+
+        auto& rt = blendDesc.RenderTarget[0];
+        rt.BlendEnable = TRUE;
+        rt.SrcBlend = D3D11_BLEND_SRC_ALPHA;
+        rt.DestBlend = D3D11_BLEND_INV_SRC_ALPHA;
+        rt.SrcBlendAlpha = D3D11_BLEND_ONE;
+        rt.DestBlendAlpha = D3D11_BLEND_INV_SRC_ALPHA;
+        ThrowOnFailure(dev->CreateBlendState(&blendDesc, &states[AlphaBlendPipeline].blendState));
+
+        states[OpaqueInstancedPipeline] = states[OpaquePipeline];
+        states[AlphaBlendInstancedPipeline] = states[AlphaBlendPipeline];
+    }(device, pipelines);
 
     [](ID3D11Device* dev, ID3D11SamplerState** ss) {
         CD3D11_SAMPLER_DESC desc{D3D11_DEFAULT};
@@ -471,29 +1299,10 @@ DirectX11::DirectX11(HINSTANCE hinst_, const Recti& vp) : hinst{hinst_} {
         dev->CreateSamplerState(&desc, ss);
     }(device, &samplerState);
 
-    [this](ID3D11Device* dev, ID3D11VertexShader** vertexShader, ID3D11InputLayout** il) {
-        D3D11_INPUT_ELEMENT_DESC desc[] = {
-            {"Position", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0, offsetof(Model::Vertex, pos),
-             D3D11_INPUT_PER_VERTEX_DATA, 0},
-            {"Color", 0, DXGI_FORMAT_R8G8B8A8_UNORM, 0, offsetof(Model::Vertex, c),
-             D3D11_INPUT_PER_VERTEX_DATA, 0},
-            {"TexCoord", 0, DXGI_FORMAT_R32G32_FLOAT, 0, offsetof(Model::Vertex, u),
-             D3D11_INPUT_PER_VERTEX_DATA, 0},
-        };
-
-        const char* VertexShaderSrc = R"(
-        float4x4 Proj, View, World;
-        void main(in float4 Position : POSITION, in float4 Color : COLOR0, in float2 TexCoord : TEXCOORD0, 
-                  out float4 oPosition : SV_Position, out float4 oColor : COLOR0, out float2 oTexCoord : TEXCOORD0, 
-                  out float3 oWorldPos : TEXCOORD1)
-        {
-            float4 wp = mul(World, Position);
-            oPosition = mul(Proj, mul(View, wp));
-            oColor = Color;
-            oTexCoord = TexCoord;
-            oWorldPos = wp;
-        })";
-
+    // Both vertex shaders declare the same constants so either can provide the uniform layout
+    auto createVertexShader = [this](ID3D11Device* dev, const char* VertexShaderSrc,
+                                     const D3D11_INPUT_ELEMENT_DESC* desc, UINT descCount,
+                                     ID3D11VertexShader** vertexShader, ID3D11InputLayout** il) {
         ID3DBlobPtr blobData;
         ThrowOnFailure(D3DCompile(VertexShaderSrc, strlen(VertexShaderSrc), nullptr, nullptr,
                                   nullptr, "main", "vs_4_0", 0, 0, &blobData, nullptr));
@@ -516,16 +1325,91 @@ DirectX11::DirectX11(HINSTANCE hinst_, const Recti& vp) : hinst{hinst_} {
         }
         uniformData.resize(bufd.Size);
 
-        device->CreateInputLayout(desc, 3, blobData->GetBufferPointer(), blobData->GetBufferSize(),
-                                  il);
-    }(device, &vShader, &inputLayout);
+        device->CreateInputLayout(desc, descCount, blobData->GetBufferPointer(),
+                                  blobData->GetBufferSize(), il);
+    };
 
-    [](ID3D11Device* dev, ID3D11PixelShader** pixelShader) {
-        const char* PixelShaderSrc = R"(
-        Texture2D Texture : register(t0);
-        SamplerState Linear : register(s0);
-        float4 main(in float4 Position : SV_Position, in float4 Color : COLOR0, in float2 TexCoord : TEXCOORD0, 
-                    in float3 worldPos : TEXCOORD1) : SV_Target
+    [&createVertexShader](ID3D11Device* dev, ID3D11VertexShader** vertexShader,
+                          ID3D11InputLayout** il) {
+        D3D11_INPUT_ELEMENT_DESC desc[] = {
+            {"Position", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0, offsetof(Model::Vertex, pos),
+             D3D11_INPUT_PER_VERTEX_DATA, 0},
+            {"Color", 0, DXGI_FORMAT_R8G8B8A8_UNORM, 0, offsetof(Model::Vertex, c),
+             D3D11_INPUT_PER_VERTEX_DATA, 0},
+            {"TexCoord", 0, DXGI_FORMAT_R32G32_FLOAT, 0, offsetof(Model::Vertex, u),
+             D3D11_INPUT_PER_VERTEX_DATA, 0},
+        };
+
+        const char* VertexShaderSrc = R"(
+        float4x4 Proj, View, World;
+        void main(in float4 Position : POSITION, in float4 Color : COLOR0, in float2 TexCoord : TEXCOORD0, 
+                  out float4 oPosition : SV_Position, out float4 oColor : COLOR0, out float2 oTexCoord : TEXCOORD0, 
+                  out float3 oWorldPos : TEXCOORD1)
+        {
+            float4 wp = mul(World, Position);
+            oPosition = mul(Proj, mul(View, wp));
+            oColor = Color;
+            oTexCoord = TexCoord;
+            oWorldPos = wp;
+        })";
+
+        createVertexShader(dev, VertexShaderSrc, desc, 3, vertexShader, il);
+    }(device, &vShader, &inputLayout);
+
+    [&createVertexShader](ID3D11Device* dev, ID3D11VertexShader** vertexShader,
+                          ID3D11InputLayout** il) {
+        const UINT instanceRows = offsetof(Model::Instance, world);
+        D3D11_INPUT_ELEMENT_DESC desc[] = {
+            {"Position", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0, offsetof(Model::Vertex, pos),
+             D3D11_INPUT_PER_VERTEX_DATA, 0},
+            {"Color", 0, DXGI_FORMAT_R8G8B8A8_UNORM, 0, offsetof(Model::Vertex, c),
+             D3D11_INPUT_PER_VERTEX_DATA, 0},
+            {"TexCoord", 0, DXGI_FORMAT_R32G32_FLOAT, 0, offsetof(Model::Vertex, u),
+             D3D11_INPUT_PER_VERTEX_DATA, 0},
+            {"Instance", 0, DXGI_FORMAT_R32G32B32A32_FLOAT, 1, instanceRows,
+             D3D11_INPUT_PER_INSTANCE_DATA, 1},
+            {"Instance", 1, DXGI_FORMAT_R32G32B32A32_FLOAT, 1, instanceRows + 16,
+             D3D11_INPUT_PER_INSTANCE_DATA, 1},
+            {"Instance", 2, DXGI_FORMAT_R32G32B32A32_FLOAT, 1, instanceRows + 32,
+             D3D11_INPUT_PER_INSTANCE_DATA, 1},
+            {"Color", 1, DXGI_FORMAT_R8G8B8A8_UNORM, 1, offsetof(Model::Instance, c),
+             D3D11_INPUT_PER_INSTANCE_DATA, 1},
+        };
+
+        const char* VertexShaderSrc = R"(
+        float4x4 Proj, View, World;
+        void main(in float4 Position : POSITION, in float4 Color : COLOR0, in float2 TexCoord : TEXCOORD0, 
+                  in float4 Row0 : INSTANCE0, in float4 Row1 : INSTANCE1,
+                  in float4 Row2 : INSTANCE2, in float4 InstanceColor : COLOR1,
+                  out float4 oPosition : SV_Position, out float4 oColor : COLOR0, out float2 oTexCoord : TEXCOORD0, 
+                  out float3 oWorldPos : TEXCOORD1)
+        {
+            float4 ip = float4(dot(Row0, Position), dot(Row1, Position), dot(Row2, Position), 1);
+            float4 wp = mul(World, ip);
+            oPosition = mul(Proj, mul(View, wp));
+            oColor = Color * InstanceColor;
+            oTexCoord = TexCoord;
+            oWorldPos = wp;
+        })";
+
+        createVertexShader(dev, VertexShaderSrc, desc, 7, vertexShader, il);
+    }(device, &vShaderInstanced, &inputLayoutInstanced);
+
+    for (int pipeline = 0; pipeline < PipelineCount; ++pipeline) {
+        const bool instanced =
+            pipeline == OpaqueInstancedPipeline || pipeline == AlphaBlendInstancedPipeline;
+        pipelines[pipeline].vertexShader = instanced ? vShaderInstanced : vShader;
+        pipelines[pipeline].inputLayout = instanced ? inputLayoutInstanced : inputLayout;
+    }
+
+    transient.AllocateBuffer(device, context, memory, 4 << 20);
+
+    [](ID3D11Device* dev, ID3D11PixelShader** pixelShader) {
+        const char* PixelShaderSrc = R"(
+        Texture2D Texture : register(t0);
+        SamplerState Linear : register(s0);
+        float4 main(in float4 Position : SV_Position, in float4 Color : COLOR0, in float2 TexCoord : TEXCOORD0, 
+                    in float3 worldPos : TEXCOORD1) : SV_Target
         {
             float3 tan = ddx(worldPos);
             float3 bin = ddy(worldPos);
@@ -549,6 +1433,14 @@ DirectX11::~DirectX11() {
     UnregisterClassW(L"OVRAppWindow", hinst);
 }
 
+void DirectX11::BeginFrame() {
+    stats = Stats{};
+    memory.NextFrame();
+    transient.Retire();
+}
+
+void DirectX11::EndFrame() { transient.EndFrame(); }
+
 void DirectX11::ClearAndSetEyeTarget(const EyeTarget& eyeTarget) {
     const float black[] = {0.f, 0.f, 0.f, 1.f};
     ID3D11RenderTargetView* rtvs[] = {eyeTarget.rtv};
@@ -563,56 +1455,381 @@ void DirectX11::ClearAndSetEyeTarget(const EyeTarget& eyeTarget) {
     d3dvp.MinDepth = 0.f;
     d3dvp.MaxDepth = 1.f;
     context->RSSetViewports(1, &d3dvp);
+
+    // State shared by every draw
+    context->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+    ID3D11Buffer* vsConstantBuffers[] = {uniformBufferGen};
+    context->VSSetConstantBuffers(0, 1, vsConstantBuffers);
+    context->PSSetShader(pShader, nullptr, 0);
+    ID3D11SamplerState* samplerStates[] = {samplerState};
+    context->PSSetSamplers(0, 1, samplerStates);
+    // Unbind the last eye's texture so the cached state below matches the device
+    ID3D11ShaderResourceView* srvs[] = {nullptr};
+    context->PSSetShaderResources(0, 1, srvs);
+    bound = BoundState{};
 }
 
-void DirectX11::Render(ID3D11ShaderResourceView* texSrv, ID3D11Buffer* vertices,
-                       ID3D11Buffer* indices, UINT stride, int count) {
-    context->IASetInputLayout(inputLayout);
-    context->IASetIndexBuffer(indices, DXGI_FORMAT_R16_UINT, 0);
+void DirectX11::Render(const Model& model) {
+    Bind(model.GetPipeline(), model.textureSrv, model.vertexBuffer, model.indexBuffer,
+         sizeof(Model::Vertex));
+    context->DrawIndexed(model.indexCount, 0, 0);
+    ++stats.draws;
+}
 
-    UINT offset = 0;
-    ID3D11Buffer* vertexBuffers[] = {vertices};
-    context->IASetVertexBuffers(0, 1, vertexBuffers, &stride, &offset);
+void DirectX11::RenderInstanced(const Model& model, const Model::Instance* instances,
+                                int instanceCount) {
+    UINT instanceStride = sizeof(Model::Instance);
+    const UINT first = transient.Write(context, instances, instanceCount, instanceStride);
+    Bind(model.GetPipeline(), model.textureSrv, model.vertexBuffer, model.indexBuffer,
+         sizeof(Model::Vertex));
+
+    // Instance data lives in the streaming buffer so it moves on every draw
+    UINT instanceOffset = first * instanceStride;
+    ID3D11Buffer* instanceBuffers[] = {transient.buffer};
+    context->IASetVertexBuffers(1, 1, instanceBuffers, &instanceStride, &instanceOffset);
+    ++stats.bufferChanges;
+
+    context->DrawIndexedInstanced(model.indexCount, instanceCount, 0, 0, 0);
+    ++stats.draws;
+    stats.instances += instanceCount;
+}
+
+void DirectX11::RenderTransient(Pipeline pipeline, ID3D11ShaderResourceView* texSrv, UINT stride,
+                                int count, UINT first) {
+    Bind(pipeline, texSrv, transient.buffer, nullptr, stride);
+    context->Draw(count, first);
+    ++stats.draws;
+}
+
+void DirectX11::Bind(Pipeline pipeline, ID3D11ShaderResourceView* texSrv, ID3D11Buffer* vertices,
+                     ID3D11Buffer* indices, UINT stride) {
+    if (bound.pipeline != pipeline) {
+        context->OMSetBlendState(pipelines[pipeline].blendState, nullptr, 0xffffffff);
+        context->OMSetDepthStencilState(pipelines[pipeline].depthStencilState, 0);
+        context->IASetInputLayout(pipelines[pipeline].inputLayout);
+        context->VSSetShader(pipelines[pipeline].vertexShader, nullptr, 0);
+        bound.pipeline = pipeline;
+        ++stats.pipelineChanges;
+    }
+
+    // Non indexed draws leave the index buffer alone
+    if (indices && bound.indices != indices) {
+        context->IASetIndexBuffer(indices, DXGI_FORMAT_R16_UINT, 0);
+        bound.indices = indices;
+        ++stats.bufferChanges;
+    }
+
+    if (bound.vertices != vertices || bound.stride != stride) {
+        UINT offset = 0;
+        ID3D11Buffer* vertexBuffers[] = {vertices};
+        context->IASetVertexBuffers(0, 1, vertexBuffers, &stride, &offset);
+        bound.vertices = vertices;
+        bound.stride = stride;
+        ++stats.bufferChanges;
+    }
 
     D3D11_MAPPED_SUBRESOURCE map;
     context->Map(uniformBufferGen, 0, D3D11_MAP_WRITE_DISCARD, 0, &map);
     memcpy(map.pData, uniformData.data(), uniformData.size());
     context->Unmap(uniformBufferGen, 0);
 
-    ID3D11Buffer* vsConstantBuffers[] = {uniformBufferGen};
-    context->VSSetConstantBuffers(0, 1, vsConstantBuffers);
-
-    context->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
-    context->VSSetShader(vShader, nullptr, 0);
-    context->PSSetShader(pShader, nullptr, 0);
-    ID3D11SamplerState* samplerStates[] = {samplerState};
-    context->PSSetSamplers(0, 1, samplerStates);
-    if (texSrv) {
+    // A null texture is bound too, it samples as zero
+    if (bound.texSrv != texSrv) {
         ID3D11ShaderResourceView* srvs[] = {texSrv};
         context->PSSetShaderResources(0, 1, srvs);
+        bound.texSrv = texSrv;
+        ++stats.textureChanges;
     }
-    context->DrawIndexed(count, 0, 0);
 }
 
 void DirectX11::SetUniform(const char* name, int n, const float* v) {
     memcpy(uniformData.data() + uniformOffsets[name], v, n * sizeof(float));
 }
+#endif
+
+RingAllocator::Allocation RingAllocator::Allocate(uint32_t bytes, uint32_t alignment) {
+    if (bytes > size) throw runtime_error{"Transient allocation larger than the ring"};
+
+    // Align within the buffer and skip to the start of the next lap if the end is too short
+    const uint32_t offset = static_cast<uint32_t>(head % size);
+    const uint64_t lapStart = head - offset;
+    const uint64_t aligned = (offset + alignment - 1) / alignment * alignment;
+    uint64_t start = aligned + bytes <= size ? lapStart + aligned : lapStart + size;
+
+    Allocation result{};
+    if (discardNext || start + bytes - tail > size) {
+        // Not enough retired space, DISCARD hands us fresh memory so whatever is still in flight
+        // can be forgotten.
+        start = offset ? lapStart + size : head;
+        tail = start;
+        frames.clear();
+        discardNext = false;
+        result.discard = true;
+    }
+
+    head = start + bytes;
+    result.offset = static_cast<uint32_t>(start % size);
+    return result;
+}
+
+void RingAllocator::Retire(uint64_t completedFence) {
+    while (!frames.empty() && frames.front().first <= completedFence) {
+        tail = frames.front().second;
+        frames.pop_front();
+    }
+}
+
+int CheckRingAllocator(int frameCount) {
+    // The fake GPU finishes each frame zero to three frames after it was submitted
+    struct FakeFences : FenceSource {
+        uint64_t signalled = 0, completed = 0;
+        unsigned random = 12345;
+
+        unsigned Next() {
+            random = random * 1103515245 + 12345;
+            return random >> 16;
+        }
+        uint64_t Signal() override { return ++signalled; }
+        uint64_t Completed() override {
+            const uint64_t lag = Next() % 4;
+            if (signalled > lag) completed = max(completed, signalled - lag);
+            return completed;
+        }
+    };
+
+    const uint32_t size = 64 << 10;
+    FakeFences fences;
+    RingAllocator ring{size};
+    vector<uint64_t> owner(size, 0);  // Fence of the frame that last wrote each byte, 0 if free
+    int errors = 0, wraps = 0, retires = 0, discards = 0;
+    uint32_t lastOffset = 0;
+
+    for (int frame = 0; frame < frameCount; ++frame) {
+        const uint64_t completed = fences.Completed();
+        if (!ring.frames.empty() && ring.frames.front().first <= completed) ++retires;
+        ring.Retire(completed);
+
+        const uint64_t fence = fences.signalled + 1;  // Signalled at the end of this frame
+        const int allocationCount = 1 + fences.Next() % 8;
+        for (int i = 0; i < allocationCount; ++i) {
+            const uint32_t stride = 4 + 4 * (fences.Next() % 16);
+            const uint32_t count = 1 + fences.Next() % (size / 8 / stride);
+            const auto allocation = ring.Allocate(count * stride, stride);
+            if (allocation.discard) {
+                // The driver hands out fresh memory, the old contents stay with the GPU
+                fill(begin(owner), end(owner), 0);
+                ++discards;
+            } else if (allocation.offset < lastOffset) {
+                ++wraps;
+            }
+            if (allocation.offset % stride || allocation.offset + count * stride > size) ++errors;
+            for (uint32_t b = allocation.offset; b < allocation.offset + count * stride; ++b) {
+                if (owner[b] > completed) ++errors;
+                owner[b] = fence;
+            }
+            lastOffset = allocation.offset;
+        }
+        ring.EndFrame(fences.Signal());
+    }
+
+    char buf[256];
+    sprintf_s(buf, "Ring check: %d frames, %d wraps, %d retires, %d discards, %d errors\n",
+              frameCount, wraps, retires, discards, errors);
+    OutputDebugStringA(buf);
+    // A run that never wraps, retires or discards hasn't checked anything
+    return errors + (wraps && retires && discards ? 0 : 1);
+}
+
+#ifdef _WIN32
+void TransientBuffer::AllocateBuffer(ID3D11Device* device, ID3D11DeviceContext* context,
+                                     MemoryTracker& tracker, UINT size) {
+    const CD3D11_BUFFER_DESC desc{size, D3D11_BIND_VERTEX_BUFFER, D3D11_USAGE_DYNAMIC,
+                                  D3D11_CPU_ACCESS_WRITE};
+    ThrowOnFailure(device->CreateBuffer(&desc, nullptr, &buffer));
+    ring = RingAllocator{size};
+    fences = make_unique<D3D11Fences>(device, context);
+    memory = TrackedMemory{tracker, MemoryTracker::Gpu, MemoryTracker::Staging, size};
+}
+
+void* TransientBuffer::Map(ID3D11DeviceContext* context, UINT count, UINT stride, UINT& first) {
+    const auto allocation = ring.Allocate(count * stride, stride);
+    D3D11_MAPPED_SUBRESOURCE map;
+    ThrowOnFailure(context->Map(buffer, 0, allocation.discard ? D3D11_MAP_WRITE_DISCARD
+                                                              : D3D11_MAP_WRITE_NO_OVERWRITE,
+                                0, &map));
+    first = allocation.offset / stride;
+    return static_cast<uint8_t*>(map.pData) + allocation.offset;
+}
+
+UINT TransientBuffer::Write(ID3D11DeviceContext* context, const void* data, UINT count,
+                            UINT stride) {
+    UINT first;
+    memcpy(Map(context, count, stride, first), data, count * stride);
+    Unmap(context);
+    return first;
+}
+
+uint64_t D3D11Fences::Signal() {
+    ID3D11QueryPtr query;
+    if (freeQueries.empty()) {
+        const CD3D11_QUERY_DESC desc{D3D11_QUERY_EVENT};
+        ThrowOnFailure(device->CreateQuery(&desc, &query));
+    } else {
+        query = freeQueries.back();
+        freeQueries.pop_back();
+    }
+    context->End(query);
+    pending.emplace_back(++signalled, query);
+    return signalled;
+}
+
+uint64_t D3D11Fences::Completed() {
+    while (!pending.empty() &&
+           context->GetData(pending.front().second, nullptr, 0,
+                            D3D11_ASYNC_GETDATA_DONOTFLUSH) == S_OK) {
+        completed = pending.front().first;
+        freeQueries.push_back(pending.front().second);
+        pending.pop_front();
+    }
+    return completed;
+}
+#endif
+
+void RenderQueue::Add(Layer layer, unsigned pipeline, const void* texture, float viewDepth,
+                      int model) {
+    const auto id = textureIds.emplace(texture, static_cast<uint32_t>(textureIds.size()));
+    if (id.first->second > 0xffff) throw runtime_error{"Too many textures in one render queue"};
+    const uint64_t textureId = id.first->second;
+
+    // Positive floats order the same as their bit patterns, dropping the low mantissa bits
+    // leaves a 24 bit depth that is finer close to the viewer.
+    uint32_t depthBits;
+    viewDepth = max(viewDepth, 0.0f);
+    memcpy(&depthBits, &viewDepth, sizeof(depthBits));
+    const uint64_t depth = depthBits >> 8;
+
+    // Opaque:      layer:2 | pipeline:6 | texture:16 | depth:24 | unused:16
+    // Transparent: layer:2 | ~depth:24 | pipeline:6 | texture:16 | unused:16
+    uint64_t key = static_cast<uint64_t>(layer) << 62;
+    if (layer == OpaqueLayer)
+        key |= uint64_t{pipeline & 0x3f} << 56 | textureId << 40 | depth << 16;
+    else
+        key |= (~depth & 0xffffff) << 38 | uint64_t{pipeline & 0x3f} << 32 | textureId << 16;
+
+    items.push_back(Item{key, model});
+}
 
-void Model::AllocateBuffers(ID3D11Device* device) {
+// LSD radix sort on 8 bit digits, skipping digits that are the same for every key.
+void RenderQueue::Sort() {
+    scratch.resize(items.size());
+    for (int shift = 0; shift < 64; shift += 8) {
+        array<size_t, 256> counts;
+        counts.fill(0);
+        for (const auto& item : items) ++counts[(item.key >> shift) & 0xff];
+        if (any_of(begin(counts), end(counts), [this](size_t c) { return c == items.size(); }))
+            continue;
+
+        size_t offset = 0;
+        for (auto& count : counts) {
+            const size_t start = offset;
+            offset += count;
+            count = start;
+        }
+        for (const auto& item : items) scratch[counts[(item.key >> shift) & 0xff]++] = item;
+        items.swap(scratch);
+    }
+}
+
+void Model::AllocateBuffers(ID3D11Device* device, MemoryTracker& memory) {
+    indexCount = static_cast<int>(indices.size());
+    if (!device) {
+        vertexMemory = TrackedMemory{memory, MemoryTracker::Cpu, MemoryTracker::VertexBuffers,
+                                     vertices.size() * sizeof(vertices[0])};
+        indexMemory = TrackedMemory{memory, MemoryTracker::Cpu, MemoryTracker::IndexBuffers,
+                                    indices.size() * sizeof(indices[0])};
+        return;
+    }
+
+#ifdef _WIN32
     D3D11_SUBRESOURCE_DATA sr{};
 
+    // Model geometry never changes after creation so the buffers are immutable
     const CD3D11_BUFFER_DESC vbdesc(vertices.size() * sizeof(vertices[0]), D3D11_BIND_VERTEX_BUFFER,
-                                    D3D11_USAGE_DYNAMIC, D3D11_CPU_ACCESS_WRITE);
+                                    D3D11_USAGE_IMMUTABLE);
     sr.pSysMem = vertices.data();
     ThrowOnFailure(device->CreateBuffer(&vbdesc, &sr, &vertexBuffer));
+    vertexMemory = TrackedMemory{memory, MemoryTracker::Gpu, MemoryTracker::VertexBuffers,
+                                 vbdesc.ByteWidth};
 
     const CD3D11_BUFFER_DESC ibdesc(indices.size() * sizeof(indices[0]), D3D11_BIND_INDEX_BUFFER,
-                                    D3D11_USAGE_DYNAMIC, D3D11_CPU_ACCESS_WRITE);
+                                    D3D11_USAGE_IMMUTABLE);
     sr.pSysMem = indices.data();
     ThrowOnFailure(device->CreateBuffer(&ibdesc, &sr, &indexBuffer));
+    indexMemory = TrackedMemory{memory, MemoryTracker::Gpu, MemoryTracker::IndexBuffers,
+                                ibdesc.ByteWidth};
+
+    // The GPU has its own copy now, drop ours
+    vector<Vertex>().swap(vertices);
+    vector<uint16_t>().swap(indices);
+#endif
+}
+
+Pipeline Model::GetPipeline() const {
+    if (instances.empty()) return transparent ? AlphaBlendPipeline : OpaquePipeline;
+    return transparent ? AlphaBlendInstancedPipeline : OpaqueInstancedPipeline;
+}
+
+const void* Model::GetTexture() const {
+#ifdef _WIN32
+    if (textureSrv) return textureSrv.GetInterfacePtr();
+#endif
+    return softwareTexture;
+}
+
+void Model::AddInstance(const Matrix4f& world, Color c) {
+    // The mesh bounds become the bounds of one instance, the model bounds cover all of them
+    if (instances.empty()) {
+        meshBounds = bounds;
+        bounds = Aabb{};
+        parts.clear();
+    }
+
+    Instance instance;
+    for (int row = 0; row < 3; ++row)
+        for (int col = 0; col < 4; ++col) instance.world[row][col] = world.M[row][col];
+    instance.c = c;
+    instances.push_back(instance);
+
+    Aabb instanceBounds;
+    for (int corner = 0; corner < 8; ++corner) {
+        const Vector3f p{corner & 1 ? meshBounds.hi.x : meshBounds.lo.x,
+                         corner & 2 ? meshBounds.hi.y : meshBounds.lo.y,
+                         corner & 4 ? meshBounds.hi.z : meshBounds.lo.z};
+        instanceBounds.Add(world.Transform(p));
+    }
+    bounds.Add(instanceBounds);
+    parts.push_back(instanceBounds);
+}
+
+uint64_t Model::ContentHash() const {
+    uint64_t hash = 14695981039346656037ull;
+    auto hashBytes = [&hash](const void* data, size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+            hash ^= static_cast<const uint8_t*>(data)[i];
+            hash *= 1099511628211ull;
+        }
+    };
+    hashBytes(vertices.data(), vertices.size() * sizeof(vertices[0]));
+    hashBytes(indices.data(), indices.size() * sizeof(indices[0]));
+    return hash;
 }
 
 void Model::AddSolidColorBox(float x1, float y1, float z1, float x2, float y2, float z2, Color c) {
+    const Aabb box{Vector3f{min(x1, x2), min(y1, y2), min(z1, z2)},
+                   Vector3f{max(x1, x2), max(y1, y2), max(z1, z2)}};
+    bounds.Add(box);
+    parts.push_back(box);
+
     const uint16_t CubeIndices[] = {0,  1,  3,  3,  1,  2,  5,  4,  6,  6,  4,  7,
                                     8,  9,  11, 11, 9,  10, 13, 12, 14, 14, 12, 15,
                                     16, 17, 19, 19, 17, 18, 21, 20, 22, 22, 20, 23};
@@ -645,14 +1862,453 @@ void Model::AddSolidColorBox(float x1, float y1, float z1, float x2, float y2, f
     }
 }
 
-Scene::Scene(ID3D11Device* device, ID3D11DeviceContext* deviceContext) {
+void Aabb::Add(const Vector3f& p) {
+    lo = Vector3f{min(lo.x, p.x), min(lo.y, p.y), min(lo.z, p.z)};
+    hi = Vector3f{max(hi.x, p.x), max(hi.y, p.y), max(hi.z, p.z)};
+}
+
+void Aabb::Add(const Aabb& b) {
+    Add(b.lo);
+    Add(b.hi);
+}
+
+float Aabb::SurfaceArea() const {
+    const Vector3f e = hi - lo;
+    return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+}
+
+float Aabb::DistanceSq(const Vector3f& p) const {
+    const Vector3f d{max(max(lo.x - p.x, p.x - hi.x), 0.0f), max(max(lo.y - p.y, p.y - hi.y), 0.0f),
+                     max(max(lo.z - p.z, p.z - hi.z), 0.0f)};
+    return d.LengthSq();
+}
+
+bool Aabb::RayHit(const Ray& ray, float tMax, float& tEntry) const {
+    float t0 = 0.0f, t1 = tMax;
+    for (int axis = 0; axis < 3; ++axis) {
+        float tNear = (lo[axis] - ray.origin[axis]) * ray.invDir[axis];
+        float tFar = (hi[axis] - ray.origin[axis]) * ray.invDir[axis];
+        if (tNear > tFar) swap(tNear, tFar);
+        t0 = max(t0, tNear);
+        t1 = min(t1, tFar);
+        if (t0 > t1) return false;
+    }
+    tEntry = t0;
+    return true;
+}
+
+Frustum::Frustum(const Matrix4f& viewProj) {
+    const auto& m = viewProj.M;
+    // D3D style clip space: -w <= x,y <= w and 0 <= z <= w
+    const float coeffs[6][4] = {
+        {m[3][0] + m[0][0], m[3][1] + m[0][1], m[3][2] + m[0][2], m[3][3] + m[0][3]},  // Left
+        {m[3][0] - m[0][0], m[3][1] - m[0][1], m[3][2] - m[0][2], m[3][3] - m[0][3]},  // Right
+        {m[3][0] + m[1][0], m[3][1] + m[1][1], m[3][2] + m[1][2], m[3][3] + m[1][3]},  // Bottom
+        {m[3][0] - m[1][0], m[3][1] - m[1][1], m[3][2] - m[1][2], m[3][3] - m[1][3]},  // Top
+        {m[2][0], m[2][1], m[2][2], m[2][3]},                                          // Near
+        {m[3][0] - m[2][0], m[3][1] - m[2][1], m[3][2] - m[2][2], m[3][3] - m[2][3]},  // Far
+    };
+    for (int i = 0; i < 6; ++i) {
+        planes[i].n = Vector3f{coeffs[i][0], coeffs[i][1], coeffs[i][2]};
+        planes[i].d = coeffs[i][3];
+    }
+}
+
+bool Frustum::Intersects(const Aabb& b) const {
+    for (const auto& plane : planes) {
+        // Test the box corner furthest along the plane normal
+        const Vector3f p{plane.n.x > 0 ? b.hi.x : b.lo.x, plane.n.y > 0 ? b.hi.y : b.lo.y,
+                         plane.n.z > 0 ? b.hi.z : b.lo.z};
+        if (plane.n.Dot(p) + plane.d < 0) return false;
+    }
+    return true;
+}
+
+void Bvh::Build(const vector<Aabb>& itemBounds) {
+    nodes.clear();
+    nodes.reserve(itemBounds.size() * 2);
+    leafOf.assign(itemBounds.size(), -1);
+    root = -1;
+    if (itemBounds.empty()) return;
+
+    vector<int> items(itemBounds.size());
+    for (size_t i = 0; i < items.size(); ++i) items[i] = static_cast<int>(i);
+    root = BuildRange(items.data(), static_cast<int>(items.size()), itemBounds, -1);
+}
+
+int Bvh::BuildRange(int* items, int count, const vector<Aabb>& itemBounds, int parent) {
+    const int index = static_cast<int>(nodes.size());
+    nodes.emplace_back();
+    nodes[index].parent = parent;
+
+    if (count == 1) {
+        nodes[index].bounds = itemBounds[items[0]];
+        nodes[index].item = items[0];
+        leafOf[items[0]] = index;
+        return index;
+    }
+
+    Aabb centroidBounds;
+    for (int i = 0; i < count; ++i) centroidBounds.Add(itemBounds[items[i]].Center());
+    const Vector3f extent = centroidBounds.hi - centroidBounds.lo;
+    const int axis =
+        extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+
+    // Binned SAH: bucket the centroids along the widest axis and sweep for the cheapest split
+    const int binCount = 16;
+    auto binOf = [&](int item) {
+        const float rel =
+            (itemBounds[item].Center()[axis] - centroidBounds.lo[axis]) / extent[axis];
+        return min(static_cast<int>(rel * binCount), binCount - 1);
+    };
+
+    int mid = count / 2;
+    if (extent[axis] > 0.0f) {
+        array<Aabb, binCount> binBounds;
+        array<int, binCount> binCounts;
+        binCounts.fill(0);
+        for (int i = 0; i < count; ++i) {
+            const int bin = binOf(items[i]);
+            binBounds[bin].Add(itemBounds[items[i]]);
+            ++binCounts[bin];
+        }
+
+        array<float, binCount> rightCost;
+        Aabb right;
+        int rightCount = 0;
+        for (int bin = binCount - 1; bin > 0; --bin) {
+            right.Add(binBounds[bin]);
+            rightCount += binCounts[bin];
+            rightCost[bin] = rightCount ? right.SurfaceArea() * rightCount : 0.0f;
+        }
+
+        int bestSplit = -1;
+        float bestCost = FLT_MAX;
+        Aabb left;
+        int leftCount = 0;
+        for (int split = 1; split < binCount; ++split) {
+            left.Add(binBounds[split - 1]);
+            leftCount += binCounts[split - 1];
+            if (leftCount == 0 || leftCount == count) continue;
+            const float cost = left.SurfaceArea() * leftCount + rightCost[split];
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestSplit = split;
+            }
+        }
+
+        if (bestSplit > 0)
+            mid = static_cast<int>(
+                partition(items, items + count, [&](int item) { return binOf(item) < bestSplit; }) -
+                items);
+    } else {
+        nth_element(items, items + mid, items + count, [&](int a, int b) {
+            return itemBounds[a].Center()[axis] < itemBounds[b].Center()[axis];
+        });
+    }
+
+    const int left = BuildRange(items, mid, itemBounds, index);
+    const int right = BuildRange(items + mid, count - mid, itemBounds, index);
+    nodes[index].children[0] = left;
+    nodes[index].children[1] = right;
+    nodes[index].bounds = nodes[left].bounds;
+    nodes[index].bounds.Add(nodes[right].bounds);
+    return index;
+}
+
+void Bvh::Update(int item, const Aabb& bounds) {
+    int index = leafOf[item];
+    nodes[index].bounds = bounds;
+    for (index = nodes[index].parent; index >= 0; index = nodes[index].parent) {
+        Node& node = nodes[index];
+        node.bounds = nodes[node.children[0]].bounds;
+        node.bounds.Add(nodes[node.children[1]].bounds);
+        Rotate(index);
+    }
+}
+
+// Tries swapping a child of the node with one of its grandchildren on the other side and applies
+// the swap that most reduces the surface area of the affected child. The node's own bounds are
+// unchanged by any of these swaps.
+void Bvh::Rotate(int index) {
+    int bestSide = -1, bestGrandchild = -1;
+    float bestGain = 0.0f;
+    Aabb bestBounds;
+    for (int side = 0; side < 2; ++side) {
+        const Node& other = nodes[nodes[index].children[1 - side]];
+        if (other.IsLeaf()) continue;
+        for (int k = 0; k < 2; ++k) {
+            Aabb merged = nodes[nodes[index].children[side]].bounds;
+            merged.Add(nodes[other.children[1 - k]].bounds);
+            const float gain = other.bounds.SurfaceArea() - merged.SurfaceArea();
+            if (gain > bestGain) {
+                bestGain = gain;
+                bestSide = side;
+                bestGrandchild = k;
+                bestBounds = merged;
+            }
+        }
+    }
+    if (bestSide < 0) return;
+
+    const int a = nodes[index].children[bestSide];
+    const int otherIndex = nodes[index].children[1 - bestSide];
+    Node& other = nodes[otherIndex];
+    const int b = other.children[bestGrandchild];
+    nodes[index].children[bestSide] = b;
+    other.children[bestGrandchild] = a;
+    other.bounds = bestBounds;
+    nodes[a].parent = otherIndex;
+    nodes[b].parent = index;
+}
+
+void Bvh::QueryFrustums(const Frustum* frustums, int count, vector<int>* visible) const {
+    for (int i = 0; i < count; ++i) visible[i].clear();
+    if (root < 0) return;
+
+    // Each stack entry carries the mask of frustums its parent was still visible in
+    if (count > 32) throw runtime_error{"Too many frustums for one traversal"};
+    vector<pair<int, unsigned>> stack;
+    stack.emplace_back(root, count < 32 ? (1u << count) - 1 : ~0u);
+    while (!stack.empty()) {
+        const Node& node = nodes[stack.back().first];
+        unsigned mask = stack.back().second;
+        stack.pop_back();
+
+        for (int i = 0; i < count; ++i)
+            if ((mask & (1u << i)) && !frustums[i].Intersects(node.bounds)) mask &= ~(1u << i);
+        if (!mask) continue;
+
+        if (node.IsLeaf()) {
+            for (int i = 0; i < count; ++i)
+                if (mask & (1u << i)) visible[i].push_back(node.item);
+        } else {
+            stack.emplace_back(node.children[1], mask);
+            stack.emplace_back(node.children[0], mask);
+        }
+    }
+}
+
+template <typename LeafTest>
+Bvh::Hit Bvh::RayCast(const Ray& ray, float tMax, LeafTest leafTest) const {
+    vector<int> stack;
+    return RayCast(ray, tMax, leafTest, stack);
+}
+
+template <typename LeafTest>
+Bvh::Hit Bvh::RayCast(const Ray& ray, float tMax, LeafTest leafTest, vector<int>& stack) const {
+    Hit hit;
+    hit.t = tMax;
+    if (root < 0) return hit;
+
+    stack.clear();
+    stack.push_back(root);
+    while (!stack.empty()) {
+        const Node& node = nodes[stack.back()];
+        stack.pop_back();
+        float tEntry;
+        if (!node.bounds.RayHit(ray, hit.t, tEntry)) continue;
+
+        if (node.IsLeaf()) {
+            const float t = leafTest(node.item, ray, hit.t);
+            if (t >= 0.0f && t < hit.t) {
+                hit.t = t;
+                hit.item = node.item;
+            }
+            continue;
+        }
+
+        // Visit the nearer child first so the far one is more likely to be rejected
+        float t0 = FLT_MAX, t1 = FLT_MAX;
+        const bool hit0 = nodes[node.children[0]].bounds.RayHit(ray, hit.t, t0);
+        const bool hit1 = nodes[node.children[1]].bounds.RayHit(ray, hit.t, t1);
+        const int nearSide = t1 < t0 ? 1 : 0;
+        if (nearSide ? hit0 : hit1) stack.push_back(node.children[1 - nearSide]);
+        if (nearSide ? hit1 : hit0) stack.push_back(node.children[nearSide]);
+    }
+    return hit;
+}
+
+float Bvh::LeafBoundsHit(int item, const Ray& ray, float tMax) const {
+    float tEntry;
+    return nodes[leafOf[item]].bounds.RayHit(ray, tMax, tEntry) ? tEntry : -1.0f;
+}
+
+Bvh::Hit Bvh::RayCast(const Ray& ray, float tMax) const {
+    vector<int> stack;
+    auto leafTest = [this](int item, const Ray& r, float t) { return LeafBoundsHit(item, r, t); };
+    return RayCast(ray, tMax, leafTest, stack);
+}
+
+void Bvh::RayCastBatch(const Ray* rays, int count, float tMax, Hit* hits) const {
+    vector<int> stack;
+    auto leafTest = [this](int item, const Ray& r, float t) { return LeafBoundsHit(item, r, t); };
+    for (int i = 0; i < count; ++i) hits[i] = RayCast(rays[i], tMax, leafTest, stack);
+}
+
+Bvh::Hit Bvh::Nearest(const Vector3f& p, float maxDist) const {
+    vector<pair<float, int>> stack;
+    return Nearest(p, maxDist, stack);
+}
+
+Bvh::Hit Bvh::Nearest(const Vector3f& p, float maxDist, vector<pair<float, int>>& stack) const {
+    Hit hit;
+    float bestSq = maxDist * maxDist;
+    if (root < 0) return hit;
+
+    stack.clear();
+    stack.emplace_back(nodes[root].bounds.DistanceSq(p), root);
+    while (!stack.empty()) {
+        const float distSq = stack.back().first;
+        const Node& node = nodes[stack.back().second];
+        stack.pop_back();
+        if (distSq >= bestSq) continue;
+
+        if (node.IsLeaf()) {
+            bestSq = distSq;
+            hit.item = node.item;
+            continue;
+        }
+
+        const float d0 = nodes[node.children[0]].bounds.DistanceSq(p);
+        const float d1 = nodes[node.children[1]].bounds.DistanceSq(p);
+        const int nearSide = d1 < d0 ? 1 : 0;
+        stack.emplace_back(nearSide ? d0 : d1, node.children[1 - nearSide]);
+        stack.emplace_back(nearSide ? d1 : d0, node.children[nearSide]);
+    }
+    if (hit.item >= 0) hit.t = sqrt(bestSq);
+    return hit;
+}
+
+void Bvh::NearestBatch(const Vector3f* points, int count, float maxDist, Hit* hits) const {
+    vector<pair<float, int>> stack;
+    for (int i = 0; i < count; ++i) hits[i] = Nearest(points[i], maxDist, stack);
+}
+
+int CheckBvh(int roundCount) {
+    unsigned random = 12345;
+    auto next = [&random] {  // Uniform in [0, 1)
+        random = random * 1103515245 + 12345;
+        return (random >> 8) / 16777216.0f;
+    };
+    auto randomPoint = [&next] {
+        return Vector3f{next() * 40 - 20, next() * 10, next() * 40 - 20};
+    };
+    auto randomBox = [&next, &randomPoint] {
+        const Vector3f lo = randomPoint();
+        return Aabb{lo, lo + Vector3f{0.1f + next() * 3, 0.1f + next() * 3, 0.1f + next() * 3}};
+    };
+
+    const int itemCount = 500, queryCount = 64;
+    const float tMax = 100.0f, maxDist = 1.0f;
+    vector<Aabb> bounds(itemCount);
+    for (auto& b : bounds) b = randomBox();
+    Bvh bvh;
+    bvh.Build(bounds);
+
+    vector<Ray> rays;
+    vector<Vector3f> points;
+    vector<Bvh::Hit> hits(queryCount);
+    vector<int> visible[2], expected;
+    int errors = 0, rayHits = 0, nearHits = 0, visibleCount = 0;
+
+    for (int round = 0; round < roundCount; ++round) {
+        // Move some of the items, jumping far so the tree has to rotate, not just refit
+        for (int i = 0; i < itemCount / 10; ++i) {
+            const int item = static_cast<int>(next() * itemCount);
+            bounds[item] = randomBox();
+            bvh.Update(item, bounds[item]);
+        }
+
+        // Rays: the closest entry distance, with the same strict test as the traversal
+        rays.clear();
+        for (int q = 0; q < queryCount; ++q)
+            rays.emplace_back(randomPoint(),
+                              Vector3f{next() - 0.5f, next() - 0.5f, next() - 0.5f}.Normalized());
+        bvh.RayCastBatch(rays.data(), queryCount, tMax, hits.data());
+        for (int q = 0; q < queryCount; ++q) {
+            Bvh::Hit best;
+            best.t = tMax;
+            for (int i = 0; i < itemCount; ++i) {
+                float t;
+                if (bounds[i].RayHit(rays[q], best.t, t) && t < best.t) {
+                    best.t = t;
+                    best.item = i;
+                }
+            }
+            // Ties may pick either item, so compare distances
+            if ((hits[q].item < 0) != (best.item < 0) || hits[q].t != best.t) ++errors;
+            const Bvh::Hit single = bvh.RayCast(rays[q], tMax);
+            if (single.item != hits[q].item || single.t != hits[q].t) ++errors;
+            if (best.item >= 0) ++rayHits;
+        }
+
+        // Nearest items to random points
+        points.clear();
+        for (int q = 0; q < queryCount; ++q) points.push_back(randomPoint());
+        bvh.NearestBatch(points.data(), queryCount, maxDist, hits.data());
+        for (int q = 0; q < queryCount; ++q) {
+            float bestSq = maxDist * maxDist;
+            int bestItem = -1;
+            for (int i = 0; i < itemCount; ++i) {
+                const float distSq = bounds[i].DistanceSq(points[q]);
+                if (distSq < bestSq) {
+                    bestSq = distSq;
+                    bestItem = i;
+                }
+            }
+            if ((hits[q].item < 0) != (bestItem < 0)) ++errors;
+            if (bestItem >= 0 && (bounds[hits[q].item].DistanceSq(points[q]) != bestSq ||
+                                  hits[q].t != sqrt(bestSq)))
+                ++errors;
+            const Bvh::Hit single = bvh.Nearest(points[q], maxDist);
+            if (single.item != hits[q].item || single.t != hits[q].t) ++errors;
+            if (bestItem >= 0) ++nearHits;
+        }
+
+        // Both eyes of a player at a random spot, culled in one traversal
+        ovrFovPort fov;
+        fov.UpTan = fov.DownTan = fov.LeftTan = fov.RightTan = 1.0f;
+        const Vector3f pos = randomPoint();
+        const Matrix4f yaw = Matrix4f::RotationY(next() * 6.283185f);
+        const Vector3f forward = yaw.Transform(Vector3f{0, 0, -1});
+        vector<Frustum> frustums;
+        for (int eye = 0; eye < 2; ++eye) {
+            const Vector3f eyePos = pos + yaw.Transform(Vector3f{eye ? 0.032f : -0.032f, 0, 0});
+            frustums.emplace_back(Matrix4f(ovrMatrix4f_Projection(fov, 0.2f, 30.0f, true)) *
+                                  Matrix4f::LookAtRH(eyePos, eyePos + forward, Vector3f{0, 1, 0}));
+        }
+        bvh.QueryFrustums(frustums.data(), 2, visible);
+        for (int eye = 0; eye < 2; ++eye) {
+            expected.clear();
+            for (int i = 0; i < itemCount; ++i)
+                if (frustums[eye].Intersects(bounds[i])) expected.push_back(i);
+            sort(begin(visible[eye]), end(visible[eye]));
+            if (visible[eye] != expected) ++errors;
+            visibleCount += static_cast<int>(expected.size());
+        }
+    }
+
+    char buf[256];
+    sprintf_s(buf,
+              "BVH check: %d rounds, %d ray hits, %d nearest hits, %d visible, %d errors\n",
+              roundCount, rayHits, nearHits, visibleCount, errors);
+    OutputDebugStringA(buf);
+    // A run where the queries never find anything hasn't checked anything
+    return errors + (rayHits && nearHits && visibleCount ? 0 : 1);
+}
+
+Scene::Scene(ID3D11Device* device, ID3D11DeviceContext* deviceContext, MemoryTracker& memory) {
     // Construct textures
     const auto texWidthHeight = 256;
     const auto texCount = 5;
     ID3D11ShaderResourceViewPtr generated_texture[texCount];
+    const SoftwareTexture* software_texture[texCount] = {};
 
     for (int k = 0; k < texCount; ++k) {
         vector<Model::Color> tex_pixels(texWidthHeight * texWidthHeight);
+        const TrackedMemory stagingMemory{memory, MemoryTracker::Cpu, MemoryTracker::Staging,
+                                          tex_pixels.size() * sizeof(tex_pixels[0])};
         for (int j = 0; j < texWidthHeight; ++j)
             for (int i = 0; i < texWidthHeight; ++i) {
                 if (k == 0)
@@ -673,19 +2329,36 @@ Scene::Scene(ID3D11Device* device, ID3D11DeviceContext* deviceContext) {
                     tex_pixels[j * texWidthHeight + i] = Model::Color{128, 128, 128, 255};  // blank
             }
 
-        generated_texture[k] = [device, deviceContext, texWidthHeight](unsigned char* data) {
-            CD3D11_TEXTURE2D_DESC dsDesc(DXGI_FORMAT_R8G8B8A8_UNORM, texWidthHeight,
-                                         texWidthHeight);
+        generated_texture[k] = [this, device, deviceContext, texWidthHeight,
+                                &memory](unsigned char* data) {
+            // Full mip chain, on the GPU or kept on the CPU
+            auto mipLevels = 1u;
+            while ((texWidthHeight >> mipLevels) > 0) ++mipLevels;
+            ID3D11ShaderResourceViewPtr texSrv = nullptr;
+#ifdef _WIN32
             ID3D11Texture2DPtr tex;
-            device->CreateTexture2D(&dsDesc, nullptr, &tex);
-            ID3D11ShaderResourceViewPtr texSrv;
-            device->CreateShaderResourceView(tex, nullptr, &texSrv);
+            if (device) {
+                CD3D11_TEXTURE2D_DESC dsDesc(DXGI_FORMAT_R8G8B8A8_UNORM, texWidthHeight,
+                                             texWidthHeight, 1, mipLevels);
+                device->CreateTexture2D(&dsDesc, nullptr, &tex);
+                device->CreateShaderResourceView(tex, nullptr, &texSrv);
+                textureMemory.emplace_back(memory, MemoryTracker::Gpu, MemoryTracker::Textures,
+                                           TextureBytes(dsDesc, 4));
+            }
+#endif
+            if (!device) softwareTextures.push_back(make_unique<SoftwareTexture>());
 
             // Note data is trashed
             auto wh = texWidthHeight;
-            tex->GetDesc(&dsDesc);
-            for (auto level = 0u; level < dsDesc.MipLevels; ++level) {
-                deviceContext->UpdateSubresource(tex, level, nullptr, data, wh * 4, wh * 4);
+            for (auto level = 0u; level < mipLevels; ++level) {
+                if (device) {
+#ifdef _WIN32
+                    deviceContext->UpdateSubresource(tex, level, nullptr, data, wh * 4, wh * 4);
+#endif
+                } else {
+                    const auto texels = reinterpret_cast<const uint32_t*>(data);
+                    softwareTextures.back()->AddLevel(memory, wh, texels, level + 1 < mipLevels);
+                }
                 for (int j = 0; j < (wh & ~1); j += 2) {
                     const uint8_t* psrc = data + (wh * j * 4);
                     uint8_t* pdest = data + ((wh >> 1) * (j >> 1) * 4);
@@ -704,39 +2377,44 @@ Scene::Scene(ID3D11Device* device, ID3D11DeviceContext* deviceContext) {
             }
             return texSrv;
         }(&tex_pixels[0].r);
+        if (!device) software_texture[k] = softwareTextures.back().get();
     }
 
     // Construct geometry
-    unique_ptr<Model> m =
-        make_unique<Model>(Vector3f(0, 0, 0), generated_texture[2]);  // Moving box
+    unique_ptr<Model> m = make_unique<Model>(Vector3f(0, 0, 0), generated_texture[2],
+                                             software_texture[2]);  // Moving box
     m->AddSolidColorBox(0, 0, 0, +1.0f, +1.0f, 1.0f, Model::Color{64, 64, 64});
-    m->AllocateBuffers(device);
+    m->AllocateBuffers(device, memory);
     models.emplace_back(move(m));
 
-    m = make_unique<Model>(Vector3f(0, 0, 0), generated_texture[1]);  // Walls
+    m = make_unique<Model>(Vector3f(0, 0, 0), generated_texture[1],
+                           software_texture[1]);  // Walls
     m->AddSolidColorBox(-10.1f, 0.0f, -20.0f, -10.0f, 4.0f, 20.0f,
                         Model::Color{128, 128, 128});  // Left Wall
     m->AddSolidColorBox(-10.0f, -0.1f, -20.1f, 10.0f, 4.0f, -20.0f,
                         Model::Color{128, 128, 128});  // Back Wall
     m->AddSolidColorBox(10.0f, -0.1f, -20.0f, 10.1f, 4.0f, 20.0f,
                         Model::Color{128, 128, 128});  // Right Wall
-    m->AllocateBuffers(device);
+    m->AllocateBuffers(device, memory);
     models.emplace_back(move(m));
 
-    m = make_unique<Model>(Vector3f(0, 0, 0), generated_texture[0]);  // Floors
+    m = make_unique<Model>(Vector3f(0, 0, 0), generated_texture[0],
+                           software_texture[0]);  // Floors
     m->AddSolidColorBox(-10.0f, -0.1f, -20.0f, 10.0f, 0.0f, 20.1f,
                         Model::Color{128, 128, 128});  // Main floor
     m->AddSolidColorBox(-15.0f, -6.1f, 18.0f, 15.0f, -6.0f, 30.0f,
                         Model::Color{128, 128, 128});  // Bottom floor
-    m->AllocateBuffers(device);
+    m->AllocateBuffers(device, memory);
     models.emplace_back(move(m));
 
-    m = make_unique<Model>(Vector3f(0, 0, 0), generated_texture[4]);  // Ceiling
+    m = make_unique<Model>(Vector3f(0, 0, 0), generated_texture[4],
+                           software_texture[4]);  // Ceiling
     m->AddSolidColorBox(-10.0f, 4.0f, -20.0f, 10.0f, 4.1f, 20.1f, Model::Color{128, 128, 128});
-    m->AllocateBuffers(device);
+    m->AllocateBuffers(device, memory);
     models.emplace_back(move(m));
 
-    m = make_unique<Model>(Vector3f(0, 0, 0), generated_texture[3]);  // Fixtures & furniture
+    m = make_unique<Model>(Vector3f(0, 0, 0), generated_texture[3],
+                           software_texture[3]);  // Fixtures & furniture
     m->AddSolidColorBox(9.5f, 0.75f, 3.0f, 10.1f, 2.5f, 3.1f,
                         Model::Color{96, 96, 96});  // Right side shelf// Verticals
     m->AddSolidColorBox(9.5f, 0.95f, 3.7f, 10.1f, 2.75f, 3.8f,
@@ -749,47 +2427,600 @@ Scene::Scene(ID3D11Device* device, ID3D11DeviceContext* deviceContext) {
                         Model::Color{96, 96, 96});  // Right railing
     m->AddSolidColorBox(-10.0f, 1.1f, 20.0f, -5.0f, 1.2f, 20.1f,
                         Model::Color{96, 96, 96});  // Left railing
-    for (float f = 5.0f; f <= 9.0f; f += 1.0f) {
-        m->AddSolidColorBox(f, 0.0f, 20.0f, f + 0.1f, 1.1f, 20.1f,
-                            Model::Color{128, 128, 128});  // Left Bars
-        m->AddSolidColorBox(-f, 1.1f, 20.0f, -f - 0.1f, 0.0f, 20.1f,
-                            Model::Color{128, 128, 128});  // Right Bars
-    }
     m->AddSolidColorBox(-1.8f, 0.8f, 1.0f, 0.0f, 0.7f, 0.0f, Model::Color{128, 128, 0});  // Table
-    m->AddSolidColorBox(-1.8f, 0.0f, 0.0f, -1.7f, 0.7f, 0.1f,
-                        Model::Color{128, 128, 0});  // Table Leg
-    m->AddSolidColorBox(-1.8f, 0.7f, 1.0f, -1.7f, 0.0f, 0.9f,
-                        Model::Color{128, 128, 0});  // Table Leg
-    m->AddSolidColorBox(0.0f, 0.0f, 1.0f, -0.1f, 0.7f, 0.9f,
-                        Model::Color{128, 128, 0});  // Table Leg
-    m->AddSolidColorBox(0.0f, 0.7f, 0.0f, -0.1f, 0.0f, 0.1f,
-                        Model::Color{128, 128, 0});  // Table Leg
     m->AddSolidColorBox(-1.4f, 0.5f, -1.1f, -0.8f, 0.55f, -0.5f,
                         Model::Color{44, 44, 128});  // Chair Set
-    m->AddSolidColorBox(-1.4f, 0.0f, -1.1f, -1.34f, 1.0f, -1.04f,
-                        Model::Color{44, 44, 128});  // Chair Leg 1
-    m->AddSolidColorBox(-1.4f, 0.5f, -0.5f, -1.34f, 0.0f, -0.56f,
-                        Model::Color{44, 44, 128});  // Chair Leg 2
-    m->AddSolidColorBox(-0.8f, 0.0f, -0.5f, -0.86f, 0.5f, -0.56f,
-                        Model::Color{44, 44, 128});  // Chair Leg 2
-    m->AddSolidColorBox(-0.8f, 1.0f, -1.1f, -0.86f, 0.0f, -1.04f,
-                        Model::Color{44, 44, 128});  // Chair Leg 2
     m->AddSolidColorBox(-1.4f, 0.97f, -1.05f, -0.8f, 0.92f, -1.10f,
                         Model::Color{44, 44, 128});  // Chair Back high bar
+    m->AllocateBuffers(device, memory);
+    models.emplace_back(move(m));
+
+    m = make_unique<Model>(Vector3f(0, 0, 0), generated_texture[3],
+                           software_texture[3]);  // Glass screen, drawn after the opaque models
+    m->AddSolidColorBox(0.5f, 0.0f, 2.0f, 2.5f, 2.0f, 2.05f, Model::Color{128, 192, 255, 64});
+    m->transparent = true;
+    m->AllocateBuffers(device, memory);
+    models.emplace_back(move(m));
+
+    // Repeated fixtures are instances of shared meshes
+    auto addFixture = [&](float x1, float y1, float z1, float x2, float y2, float z2,
+                          Model::Color c) {
+        AddInstancedBox(device, memory, generated_texture[3], software_texture[3], x1, y1, z1, x2,
+                        y2, z2, c);
+    };
+    for (float f = 5.0f; f <= 9.0f; f += 1.0f) {
+        addFixture(f, 0.0f, 20.0f, f + 0.1f, 1.1f, 20.1f,
+                   Model::Color{128, 128, 128});  // Left Bars
+        addFixture(-f, 1.1f, 20.0f, -f - 0.1f, 0.0f, 20.1f,
+                   Model::Color{128, 128, 128});  // Right Bars
+    }
+    addFixture(-1.8f, 0.0f, 0.0f, -1.7f, 0.7f, 0.1f, Model::Color{128, 128, 0});  // Table Leg
+    addFixture(-1.8f, 0.7f, 1.0f, -1.7f, 0.0f, 0.9f, Model::Color{128, 128, 0});  // Table Leg
+    addFixture(0.0f, 0.0f, 1.0f, -0.1f, 0.7f, 0.9f, Model::Color{128, 128, 0});   // Table Leg
+    addFixture(0.0f, 0.7f, 0.0f, -0.1f, 0.0f, 0.1f, Model::Color{128, 128, 0});   // Table Leg
+    addFixture(-1.4f, 0.0f, -1.1f, -1.34f, 1.0f, -1.04f,
+               Model::Color{44, 44, 128});  // Chair Leg 1
+    addFixture(-1.4f, 0.5f, -0.5f, -1.34f, 0.0f, -0.56f,
+               Model::Color{44, 44, 128});  // Chair Leg 2
+    addFixture(-0.8f, 0.0f, -0.5f, -0.86f, 0.5f, -0.56f,
+               Model::Color{44, 44, 128});  // Chair Leg 2
+    addFixture(-0.8f, 1.0f, -1.1f, -0.86f, 0.0f, -1.04f,
+               Model::Color{44, 44, 128});  // Chair Leg 2
 
     for (float f = 3.0f; f <= 6.6f; f += 0.4f)
-        m->AddSolidColorBox(-3, 0.0f, f, -2.9f, 1.3f, f + 0.1f, Model::Color{64, 64, 64});  // Posts
+        addFixture(-3, 0.0f, f, -2.9f, 1.3f, f + 0.1f, Model::Color{64, 64, 64});  // Posts
 
-    m->AllocateBuffers(device);
-    models.emplace_back(move(m));
+    vector<Aabb> modelBounds;
+    for (const auto& model : models) modelBounds.push_back(model->GetWorldBounds());
+    bvh.Build(modelBounds);
+}
+
+void Scene::AddInstancedBox(ID3D11Device* device, MemoryTracker& memory,
+                            ID3D11ShaderResourceView* texSrv, const SoftwareTexture* softwareTex,
+                            float x1, float y1, float z1, float x2, float y2, float z2,
+                            Model::Color c) {
+    // Sizes are quantized to a tenth of a millimetre so that boxes that are meant to be the same
+    // size share a mesh despite float rounding in their coordinates.
+    auto size = [](float a, float b) { return floor(fabs(b - a) * 10000.0f + 0.5f) / 10000.0f; };
+    const Vector3f lo{min(x1, x2), min(y1, y2), min(z1, z2)};
+
+    // The instance color is applied in the shader so the mesh itself is white
+    auto mesh = make_unique<Model>(Vector3f(0, 0, 0), texSrv, softwareTex);
+    mesh->AddSolidColorBox(0.0f, 0.0f, 0.0f, size(x1, x2), size(y1, y2), size(z1, z2),
+                           Model::Color{255, 255, 255});
+    const uint64_t key =
+        mesh->ContentHash() ^ (reinterpret_cast<uintptr_t>(mesh->GetTexture()) * 31);
+
+    // Equal hashes only share the mesh if the geometry and texture really match
+    auto sameMesh = [&mesh](const pair<const uint64_t, InstancedMesh>& entry) {
+        const InstancedMesh& other = entry.second;
+        return other.model->GetTexture() == mesh->GetTexture() && other.indices == mesh->indices &&
+               other.vertices.size() == mesh->vertices.size() &&
+               !memcmp(other.vertices.data(), mesh->vertices.data(),
+                       mesh->vertices.size() * sizeof(mesh->vertices[0]));
+    };
+    const auto range = instancedMeshes.equal_range(key);
+    auto it = find_if(range.first, range.second, sameMesh);
+    if (it == range.second) {
+        it = instancedMeshes.emplace(key, InstancedMesh{mesh.get(), mesh->vertices, mesh->indices});
+        mesh->AllocateBuffers(device, memory);
+        models.emplace_back(move(mesh));
+    }
+    it->second.model->AddInstance(Matrix4f::Translation(lo), c);
+}
+
+void Scene::MoveModel(int index, Vector3f pos) {
+    models[index]->pos = pos;
+    bvh.Update(index, models[index]->GetWorldBounds());
+}
+
+Bvh::Hit Scene::Pick(const Ray& ray, float maxDist) const {
+    return bvh.RayCast(ray, maxDist, [this](int item, const Ray& r, float tMax) {
+        const Model& model = *models[item];
+        const Ray local{r.origin - model.pos, r.dir};
+        float best = -1.0f;
+        for (const auto& part : model.parts) {
+            float t;
+            if (part.RayHit(local, tMax, t)) {
+                best = t;
+                tMax = t;
+            }
+        }
+        return best;
+    });
+}
+
+void Scene::Cull(const Matrix4f (&view)[2], const Matrix4f (&proj)[2]) {
+    eyeFrustums.clear();
+    for (int eye = 0; eye < 2; ++eye) {
+        eyeView[eye] = view[eye];
+        eyeProj[eye] = proj[eye];
+        eyeFrustums.emplace_back(proj[eye] * view[eye]);
+    }
+    bvh.QueryFrustums(eyeFrustums.data(), 2, visible);
+}
+
+void Scene::BuildQueue(int eye) {
+    queue.Clear();
+    for (auto index : visible[eye]) {
+        const auto& model = *models[index];
+        const float viewDepth = -eyeView[eye].Transform(model.GetWorldBounds().Center()).z;
+        queue.Add(model.transparent ? RenderQueue::TransparentLayer : RenderQueue::OpaqueLayer,
+                  model.GetPipeline(), model.GetTexture(), viewDepth, index);
+    }
+    queue.Sort();
+}
+
+void Scene::CullInstances(const Model& model, const Frustum& frustum) {
+    visibleInstances.clear();
+    for (size_t i = 0; i < model.instances.size(); ++i)
+        if (frustum.Intersects(model.parts[i].Translated(model.pos)))
+            visibleInstances.push_back(model.instances[i]);
+}
+
+template <typename Renderer>
+void Scene::Render(Renderer& renderer, int eye) {
+    const Matrix4f projT = eyeProj[eye].Transposed(), viewT = eyeView[eye].Transposed();
+    renderer.SetUniform("Proj", 16, &projT.M[0][0]);
+    renderer.SetUniform("View", 16, &viewT.M[0][0]);
+
+    BuildQueue(eye);
+    for (const auto& item : queue.items) {
+        const auto& model = models[item.model];
+        const Matrix4f worldT = model->GetMatrix().Transposed();
+        renderer.SetUniform("World", 16, &worldT.M[0][0]);
+        if (model->instances.empty()) {
+            renderer.Render(*model);
+        } else {
+            // Only draw the instances inside the frustum
+            CullInstances(*model, eyeFrustums[eye]);
+            if (visibleInstances.empty()) continue;
+            renderer.RenderInstanced(*model, visibleInstances.data(),
+                                     static_cast<int>(visibleInstances.size()));
+        }
+        model->vertexMemory.Touch();
+        model->indexMemory.Touch();
+    }
+}
+
+void SoftwareTexture::AddLevel(MemoryTracker& memory, int size, const uint32_t* texels,
+                               bool evictable) {
+    const int index = static_cast<int>(levels.size());
+    levels.push_back(Level{size, vector<uint32_t>(texels, texels + size * size)});
+    function<void()> evict;
+    if (evictable) evict = [this, index] { vector<uint32_t>().swap(levels[index].texels); };
+    levelMemory.emplace_back(memory, MemoryTracker::Cpu, MemoryTracker::Textures,
+                             size * size * sizeof(uint32_t), move(evict));
+}
+
+void SoftwareTexture::Touch() const {
+    for (const auto& level : levelMemory) level.Touch();
+}
+
+void SoftwareTexture::Sample(float u, float v, float lod, float out[4]) const {
+    const int last = static_cast<int>(levels.size()) - 1;
+    int index = lod > 0.0f ? min(static_cast<int>(lod + 0.5f), last) : 0;
+    while (levels[index].texels.empty()) ++index;  // Evicted, the smallest level never is
+    const Level& level = levels[index];
+    const int mask = level.size - 1;
+    const float x = u * level.size - 0.5f, y = v * level.size - 0.5f;
+    const float fx = floor(x), fy = floor(y);
+    const float ax = x - fx, ay = y - fy;
+    const int x0 = static_cast<int>(fx) & mask, y0 = static_cast<int>(fy) & mask;
+    const int x1 = (x0 + 1) & mask, y1 = (y0 + 1) & mask;
+
+    const uint32_t texels[4] = {
+        level.texels[y0 * level.size + x0], level.texels[y0 * level.size + x1],
+        level.texels[y1 * level.size + x0], level.texels[y1 * level.size + x1]};
+    const float weights[4] = {(1 - ax) * (1 - ay), ax * (1 - ay), (1 - ax) * ay, ax * ay};
+    for (int c = 0; c < 4; ++c) {
+        float sum = 0.0f;
+        for (int i = 0; i < 4; ++i) sum += weights[i] * ((texels[i] >> (8 * c)) & 0xff);
+        out[c] = sum * (1.0f / 255.0f);
+    }
+}
+
+SoftwareTarget::SoftwareTarget(Sizei size)
+    : width{size.w},
+      height{size.h},
+      stride{(size.w + 3) & ~3},
+      color(stride * height),
+      depth(stride * height) {}
+
+void SoftwareTarget::WriteTga(const char* filename) const {
+    // Uncompressed 32 bit BGRA with a top left origin
+    const uint8_t header[18] = {0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                static_cast<uint8_t>(width), static_cast<uint8_t>(width >> 8),
+                                static_cast<uint8_t>(height), static_cast<uint8_t>(height >> 8),
+                                32, 0x28};
+    ofstream file{filename, ios::binary};
+    file.write(reinterpret_cast<const char*>(header), sizeof(header));
+
+    vector<uint8_t> row(width * 4);
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            const uint32_t c = color[y * stride + x];
+            row[x * 4 + 0] = static_cast<uint8_t>(c >> 16);
+            row[x * 4 + 1] = static_cast<uint8_t>(c >> 8);
+            row[x * 4 + 2] = static_cast<uint8_t>(c);
+            row[x * 4 + 3] = static_cast<uint8_t>(c >> 24);
+        }
+        file.write(reinterpret_cast<const char*>(row.data()), row.size());
+    }
+    if (!file) throw runtime_error{"Failed to write eye image"};
+}
+
+// Saturates and packs RGBA into the byte order of Model::Color, like an R8G8B8A8_UNORM target
+static uint32_t PackColor(const float c[4]) {
+    uint32_t packed = 0;
+    for (int i = 0; i < 4; ++i)
+        packed |= static_cast<uint32_t>(min(max(c[i], 0.0f), 1.0f) * 255.0f + 0.5f) << (8 * i);
+    return packed;
+}
+
+SoftwareRasterizer::SoftwareRasterizer(unsigned threadCount) {
+    nextTile = 0;
+    pixelsShaded = 0;
+    // The thread calling Finish rasterizes too
+    for (unsigned i = 1; i < threadCount; ++i) workers.emplace_back([this] { WorkerLoop(); });
+}
+
+SoftwareRasterizer::~SoftwareRasterizer() {
+    {
+        lock_guard<mutex> lock{workMutex};
+        quit = true;
+    }
+    workReady.notify_all();
+    for (auto& worker : workers) worker.join();
+}
+
+void SoftwareRasterizer::ClearAndSetEyeTarget(SoftwareTarget& eyeTarget) {
+    Finish();
+    target = &eyeTarget;
+    fill(begin(target->color), end(target->color), 0xff000000u);  // Opaque black
+    fill(begin(target->depth), end(target->depth), 1.0f);
+    tilesX = (target->width + TileSize - 1) / TileSize;
+    tilesY = (target->height + TileSize - 1) / TileSize;
+    bins.resize(tilesX * tilesY);
+}
+
+void SoftwareRasterizer::SetUniform(const char* name, int n, const float* v) {
+    // Matrices arrive transposed for HLSL, as for DirectX11::SetUniform
+    if (n != 16) throw runtime_error{"Software rasterizer only supports matrix uniforms"};
+    Matrix4f m;
+    memcpy(&m.M[0][0], v, sizeof(m.M));
+    uniforms[name] = m.Transposed();
+}
+
+void SoftwareRasterizer::Render(const Model& model) {
+    Draw(model.GetPipeline(), model.softwareTexture, uniforms["World"],
+         Model::Color{255, 255, 255}, model.vertices.data(), model.indices.data(),
+         model.indexCount);
+    if (model.softwareTexture) model.softwareTexture->Touch();
+}
+
+void SoftwareRasterizer::RenderInstanced(const Model& model, const Model::Instance* instances,
+                                         int instanceCount) {
+    const Matrix4f world = uniforms["World"];
+    for (int i = 0; i < instanceCount; ++i) {
+        Matrix4f instanceWorld;
+        memcpy(&instanceWorld.M[0][0], instances[i].world, sizeof(instances[i].world));
+        Draw(model.GetPipeline(), model.softwareTexture, world * instanceWorld, instances[i].c,
+             model.vertices.data(), model.indices.data(), model.indexCount);
+    }
+    if (model.softwareTexture) model.softwareTexture->Touch();
+}
+
+void SoftwareRasterizer::Draw(Pipeline pipeline, const SoftwareTexture* texture,
+                              const Matrix4f& world, Model::Color instanceColor,
+                              const Model::Vertex* vertices, const uint16_t* indices, int count) {
+    if (!target || count < 3) return;
+    ++stats.draws;
+    const Matrix4f viewProj = uniforms["Proj"] * uniforms["View"];
+    const bool blend = pipeline == AlphaBlendPipeline || pipeline == AlphaBlendInstancedPipeline;
+
+    // Vertex shader, once per vertex the indices refer to
+    const Model::Color& tint = instanceColor;
+    transformed.resize(*max_element(indices, indices + count) + 1);
+    for (size_t i = 0; i < transformed.size(); ++i) {
+        const Model::Vertex& in = vertices[i];
+        ClipVertex& out = transformed[i];
+        const Vector3f wp = world.Transform(in.pos);
+        for (int row = 0; row < 4; ++row)
+            out.pos[row] = viewProj.M[row][0] * wp.x + viewProj.M[row][1] * wp.y +
+                           viewProj.M[row][2] * wp.z + viewProj.M[row][3];
+        out.attributes[U] = in.u;
+        out.attributes[V] = in.v;
+        out.attributes[R] = in.c.r * tint.r / (255.0f * 255.0f);
+        out.attributes[G] = in.c.g * tint.g / (255.0f * 255.0f);
+        out.attributes[B] = in.c.b * tint.b / (255.0f * 255.0f);
+        out.attributes[A] = in.c.a * tint.a / (255.0f * 255.0f);
+        out.attributes[WorldX] = wp.x;
+        out.attributes[WorldY] = wp.y;
+        out.attributes[WorldZ] = wp.z;
+    }
+
+    // Triangles are clipped against the near plane and a guard band of four times the viewport,
+    // inside the guard band the tile bounds and edge functions do the clipping.
+    const float guardBand = 4.0f;
+    const float planes[5][4] = {{0, 0, 1, 0},
+                                {1, 0, 0, guardBand},
+                                {-1, 0, 0, guardBand},
+                                {0, 1, 0, guardBand},
+                                {0, -1, 0, guardBand}};
+    auto distance = [](const float plane[4], const ClipVertex& v) {
+        return plane[0] * v.pos[0] + plane[1] * v.pos[1] + plane[2] * v.pos[2] +
+               plane[3] * v.pos[3];
+    };
+    auto lerp = [](const ClipVertex& a, const ClipVertex& b, float t) {
+        ClipVertex r;
+        for (int i = 0; i < 4; ++i) r.pos[i] = a.pos[i] + (b.pos[i] - a.pos[i]) * t;
+        for (int i = 0; i < AttributeCount; ++i)
+            r.attributes[i] = a.attributes[i] + (b.attributes[i] - a.attributes[i]) * t;
+        return r;
+    };
+
+    for (int i = 0; i + 2 < count; i += 3) {
+        const ClipVertex* corners[3] = {&transformed[indices[i]], &transformed[indices[i + 1]],
+                                        &transformed[indices[i + 2]]};
+        unsigned outside[3] = {};
+        for (int v = 0; v < 3; ++v)
+            for (int p = 0; p < 5; ++p)
+                if (distance(planes[p], *corners[v]) < 0.0f) outside[v] |= 1u << p;
+        if (outside[0] & outside[1] & outside[2]) continue;
+        const unsigned crossed = outside[0] | outside[1] | outside[2];
+        if (!crossed) {
+            Setup(*corners[0], *corners[1], *corners[2], texture, blend);
+            continue;
+        }
+
+        // Sutherland-Hodgman against the planes the triangle crosses, each adds at most a vertex
+        ClipVertex polygons[2][8];
+        int n = 3, current = 0;
+        for (int v = 0; v < 3; ++v) polygons[0][v] = *corners[v];
+        for (int p = 0; p < 5 && n >= 3; ++p) {
+            if (!(crossed & (1u << p))) continue;
+            const ClipVertex* in = polygons[current];
+            ClipVertex* out = polygons[1 - current];
+            int outCount = 0;
+            for (int v = 0; v < n; ++v) {
+                const ClipVertex& a = in[v];
+                const ClipVertex& b = in[(v + 1) % n];
+                const float da = distance(planes[p], a), db = distance(planes[p], b);
+                if (da >= 0.0f) out[outCount++] = a;
+                // Crossings are always interpolated from the inside end, so a neighbouring
+                // triangle walking the shared edge the other way gets the identical vertex
+                if ((da >= 0.0f) != (db >= 0.0f))
+                    out[outCount++] = da >= 0.0f ? lerp(a, b, da / (da - db))
+                                                 : lerp(b, a, db / (db - da));
+            }
+            n = outCount;
+            current = 1 - current;
+        }
+        for (int v = 1; v + 1 < n; ++v)
+            Setup(polygons[current][0], polygons[current][v], polygons[current][v + 1], texture,
+                  blend);
+    }
 }
 
-void Scene::Render(DirectX11& dx11, const Matrix4f& view, const Matrix4f& proj) {
-    dx11.SetUniform("Proj", 16, &proj.Transposed().M[0][0]);
-    dx11.SetUniform("View", 16, &view.Transposed().M[0][0]);
-    for (auto& model : models) {
-        dx11.SetUniform("World", 16, &model->GetMatrix().Transposed().M[0][0]);
-        dx11.Render(model->textureSrv, model->vertexBuffer, model->indexBuffer,
-                    sizeof(Model::Vertex), model->indices.size());
+void SoftwareRasterizer::Setup(const ClipVertex& v0, const ClipVertex& v1, const ClipVertex& v2,
+                               const SoftwareTexture* texture, bool blend) {
+    const ClipVertex* v[3] = {&v0, &v1, &v2};
+    float x[3], y[3], z[3], invW[3];
+    for (int i = 0; i < 3; ++i) {
+        invW[i] = 1.0f / v[i]->pos[3];
+        x[i] = (v[i]->pos[0] * invW[i] * 0.5f + 0.5f) * target->width;
+        y[i] = (0.5f - v[i]->pos[1] * invW[i] * 0.5f) * target->height;
+        z[i] = v[i]->pos[2] * invW[i];
+    }
+
+    // Front faces are clockwise on screen like the default D3D rasterizer state, back faces and
+    // degenerate triangles are culled
+    const float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+    if (!(area > 0.0f)) return;
+
+    Triangle tri;
+    tri.minX = max(static_cast<int>(floor(min(min(x[0], x[1]), x[2]))), 0);
+    tri.minY = max(static_cast<int>(floor(min(min(y[0], y[1]), y[2]))), 0);
+    tri.maxX = min(static_cast<int>(ceil(max(max(x[0], x[1]), x[2]))), target->width - 1);
+    tri.maxY = min(static_cast<int>(ceil(max(max(y[0], y[1]), y[2]))), target->height - 1);
+    if (tri.minX > tri.maxX || tri.minY > tri.maxY) return;
+
+    for (int e = 0; e < 3; ++e) {
+        // Shared edges are always set up from the same end so that the two triangles get exactly
+        // negated edge functions. RasterTile evaluates them per pixel without stepping, so the
+        // negation holds at every sample and the fill rule leaves no gaps or double hits
+        int a = e, b = (e + 1) % 3;
+        const bool flip = x[b] < x[a] || (x[b] == x[a] && y[b] < y[a]);
+        if (flip) swap(a, b);
+        Interpolant& edge = tri.edges[e];
+        edge.dx = y[a] - y[b];
+        edge.dy = x[b] - x[a];
+        edge.c = -(edge.dx * x[a] + edge.dy * y[a]);
+        if (flip) {
+            edge.dx = -edge.dx;
+            edge.dy = -edge.dy;
+            edge.c = -edge.c;
+        }
+        tri.topLeft[e] = edge.dx > 0.0f || (edge.dx == 0.0f && edge.dy > 0.0f);
+    }
+
+    const float invArea = 1.0f / area;
+    auto interpolant = [&](float f0, float f1, float f2) {
+        Interpolant r;
+        r.dx = ((f1 - f0) * (y[2] - y[0]) - (f2 - f0) * (y[1] - y[0])) * invArea;
+        r.dy = ((f2 - f0) * (x[1] - x[0]) - (f1 - f0) * (x[2] - x[0])) * invArea;
+        r.c = f0 - r.dx * x[0] - r.dy * y[0];
+        return r;
+    };
+    tri.z = interpolant(z[0], z[1], z[2]);
+    tri.invW = interpolant(invW[0], invW[1], invW[2]);
+    for (int i = 0; i < AttributeCount; ++i)
+        tri.attributes[i] =
+            interpolant(v0.attributes[i] * invW[0], v1.attributes[i] * invW[1],
+                        v2.attributes[i] * invW[2]);
+
+    // The pixel shader's normalize(cross(ddy(worldPos), ddx(worldPos))) is constant over a
+    // triangle. With clockwise front faces it is the negated normal of the world space winding.
+    const Vector3f p0{v0.attributes[WorldX], v0.attributes[WorldY], v0.attributes[WorldZ]};
+    const Vector3f p1{v1.attributes[WorldX], v1.attributes[WorldY], v1.attributes[WorldZ]};
+    const Vector3f p2{v2.attributes[WorldX], v2.attributes[WorldY], v2.attributes[WorldZ]};
+    const Vector3f normal = (p1 - p0).Cross(p2 - p0);
+    const float length = normal.Length();
+    tri.normal = length > 0.0f ? normal * (-1.0f / length) : Vector3f{0, 0, 0};
+    tri.texture = texture;
+    tri.blend = blend;
+
+    const int index = static_cast<int>(triangles.size());
+    triangles.push_back(tri);
+    ++stats.triangles;
+    for (int ty = tri.minY / TileSize; ty <= tri.maxY / TileSize; ++ty)
+        for (int tx = tri.minX / TileSize; tx <= tri.maxX / TileSize; ++tx)
+            bins[ty * tilesX + tx].push_back(index);
+}
+
+void SoftwareRasterizer::Finish() {
+    if (triangles.empty()) return;
+
+    {
+        lock_guard<mutex> lock{workMutex};
+        nextTile = 0;
+        busyWorkers = static_cast<int>(workers.size());
+        ++generation;
+    }
+    workReady.notify_all();
+    RasterTiles();
+    {
+        unique_lock<mutex> lock{workMutex};
+        workDone.wait(lock, [this] { return busyWorkers == 0; });
+    }
+
+    stats.pixelsShaded += pixelsShaded.exchange(0);
+    triangles.clear();
+    for (auto& bin : bins) bin.clear();
+}
+
+void SoftwareRasterizer::WorkerLoop() {
+    int seen = 0;
+    for (;;) {
+        {
+            unique_lock<mutex> lock{workMutex};
+            workReady.wait(lock, [this, seen] { return quit || generation != seen; });
+            if (quit) return;
+            seen = generation;
+        }
+        RasterTiles();
+        {
+            lock_guard<mutex> lock{workMutex};
+            --busyWorkers;
+        }
+        workDone.notify_one();
+    }
+}
+
+void SoftwareRasterizer::RasterTiles() {
+    // Tiles are handed out one at a time so threads that get cheap tiles take more of them
+    const int tileCount = tilesX * tilesY;
+    for (int tile = nextTile++; tile < tileCount; tile = nextTile++) RasterTile(tile);
+}
+
+void SoftwareRasterizer::RasterTile(int tile) {
+    const int tileX = tile % tilesX * TileSize, tileY = tile / tilesX * TileSize;
+    const int tileMaxX = min(tileX + TileSize, target->width) - 1;
+    const int tileMaxY = min(tileY + TileSize, target->height) - 1;
+    const __m128 laneOffsets = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);  // Pixel centres
+    const __m128 zero = _mm_setzero_ps();
+    long long shaded = 0;
+
+    for (int index : bins[tile]) {
+        const Triangle& tri = triangles[index];
+        // Rows start on a multiple of four pixels, tiles and the row stride are aligned to that
+        const int minX = max(tri.minX, tileX) & ~3, maxX = min(tri.maxX, tileMaxX);
+        const int minY = max(tri.minY, tileY), maxY = min(tri.maxY, tileMaxY);
+        const __m128 lastCentre = _mm_set1_ps(maxX + 0.5f);
+
+        __m128 edgeDx[3];
+        for (int e = 0; e < 3; ++e) edgeDx[e] = _mm_set1_ps(tri.edges[e].dx);
+        const __m128 zDx = _mm_set1_ps(tri.z.dx);
+
+        for (int y = minY; y <= maxY; ++y) {
+            // Edges are evaluated directly at each pixel centre rather than stepped along the
+            // row, see Setup
+            const float centreY = y + 0.5f;
+            __m128 edgeRow[3];
+            for (int e = 0; e < 3; ++e)
+                edgeRow[e] = _mm_set1_ps(tri.edges[e].dy * centreY + tri.edges[e].c);
+            const __m128 zRow = _mm_set1_ps(tri.z.dy * centreY + tri.z.c);
+            float* depthRow = &target->depth[y * target->stride];
+            uint32_t* colorRow = &target->color[y * target->stride];
+
+            for (int x = minX; x <= maxX; x += 4) {
+                const __m128 px = _mm_add_ps(_mm_set1_ps(static_cast<float>(x)), laneOffsets);
+                __m128 mask = _mm_cmple_ps(px, lastCentre);
+                for (int e = 0; e < 3; ++e) {
+                    const __m128 edge = _mm_add_ps(_mm_mul_ps(edgeDx[e], px), edgeRow[e]);
+                    mask = _mm_and_ps(mask, tri.topLeft[e] ? _mm_cmpge_ps(edge, zero)
+                                                           : _mm_cmpgt_ps(edge, zero));
+                }
+                if (_mm_movemask_ps(mask)) {
+                    // Depth test LESS, transparent draws test but don't write
+                    const __m128 z = _mm_add_ps(_mm_mul_ps(zDx, px), zRow);
+                    const __m128 depth = _mm_loadu_ps(depthRow + x);
+                    mask = _mm_and_ps(mask, _mm_cmplt_ps(z, depth));
+                    const int lanes = _mm_movemask_ps(mask);
+                    if (lanes) {
+                        if (!tri.blend)
+                            _mm_storeu_ps(depthRow + x, _mm_or_ps(_mm_and_ps(mask, z),
+                                                                  _mm_andnot_ps(mask, depth)));
+                        for (int lane = 0; lane < 4; ++lane) {
+                            if (!(lanes & (1 << lane))) continue;
+                            colorRow[x + lane] = Shade(tri, x + lane, y, colorRow[x + lane]);
+                            ++shaded;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    pixelsShaded += shaded;
+}
+
+uint32_t SoftwareRasterizer::Shade(const Triangle& tri, int x, int y, uint32_t dest) const {
+    const float centreX = x + 0.5f, centreY = y + 0.5f;
+    const float w = 1.0f / tri.invW.At(centreX, centreY);
+    float a[AttributeCount];
+    for (int i = 0; i < AttributeCount; ++i) a[i] = tri.attributes[i].At(centreX, centreY) * w;
+
+    float texel[4] = {1.0f, 1.0f, 1.0f, 1.0f};
+    if (tri.texture) {
+        // Mip selection from the screen space derivatives of the perspective correct UVs. The 8x
+        // anisotropic sampler is approximated by following the minor axis of the footprint,
+        // limited to an 8:1 ratio.
+        const float size = static_cast<float>(tri.texture->levels[0].size);
+        const float dudx = (tri.attributes[U].dx - a[U] * tri.invW.dx) * w;
+        const float dvdx = (tri.attributes[V].dx - a[V] * tri.invW.dx) * w;
+        const float dudy = (tri.attributes[U].dy - a[U] * tri.invW.dy) * w;
+        const float dvdy = (tri.attributes[V].dy - a[V] * tri.invW.dy) * w;
+        const float lengthX = sqrt(dudx * dudx + dvdx * dvdx) * size;
+        const float lengthY = sqrt(dudy * dudy + dvdy * dvdy) * size;
+        const float minor = min(lengthX, lengthY), major = max(lengthX, lengthY);
+        tri.texture->Sample(a[U], a[V], log2(max(minor, major / 8.0f)), texel);
+    }
+
+    // Pixel shader lighting
+    const Vector3f l = Vector3f{0.0f, 3.7f, 0.0f} - Vector3f{a[WorldX], a[WorldY], a[WorldZ]};
+    const float r = l.Length();
+    const float d = tri.normal.Dot(l / r);
+    const float light = 0.5f + 10.0f * d / r;
+
+    float c[4];
+    for (int i = 0; i < 4; ++i) c[i] = min(max(a[R + i] * light * texel[i], 0.0f), 1.0f);
+    if (tri.blend) {
+        // SrcAlpha, InvSrcAlpha for color and One, InvSrcAlpha for alpha
+        const float invAlpha = 1.0f - c[3];
+        for (int i = 0; i < 3; ++i)
+            c[i] = c[i] * c[3] + ((dest >> (8 * i)) & 0xff) / 255.0f * invAlpha;
+        c[3] = c[3] + (dest >> 24) / 255.0f * invAlpha;
     }
+    return PackColor(c);
 }